@@ -0,0 +1,379 @@
+/* Copyright 2018 Google LLC
+
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/postgresql
+*/
+
+/*
+ * Generator of synthetic data directories for benchmarking
+ * pg_page_verification.
+ *
+ * This utility writes base/<oid>/<relfilenode>[.<segment>] trees of heap
+ * like pages with valid checksums, computed with the same pg_checksum_page()
+ * the server uses, and a global/pg_control with the page and segment size
+ * of the headers it is built against.  A given fraction of the pages is
+ * corrupted after its checksum is set, so that a scan of the tree has a
+ * known result.  The same seed always generates the same tree.
+ *
+ */
+
+/* standard header files */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* postgres header files */
+#include "c.h"
+#include "pg_config.h"
+#include "storage/checksum_impl.h"
+#include "storage/bufpage.h"
+#include "catalog/pg_control.h"
+
+#define FIRST_OID 16384
+#define WRITE_PAGES 128
+#define TUPLE_SIZE 128
+
+static int num_databases = 2;
+static int num_relations = 4;
+static uint64 relation_pages = 1024 * 1024 / BLCKSZ * 64;
+static double corrupt_rate = 0;
+static uint64 seed = 1;
+
+static uint64 pages_written = 0;
+static uint64 pages_corrupted = 0;
+static uint64 files_written = 0;
+
+static uint64
+next_random(void)
+{
+    /* splitmix64, like the page sampling of pg_page_verification */
+    uint64 z = (seed += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void
+fill_page(char *page, BlockNumber absblkno)
+{
+    /* A heap page of TUPLE_SIZE tuples filling the page from the end, with
+     * random contents and a consistent header.
+     */
+    PageHeader phdr = (PageHeader) page;
+    int ntuples = (BLCKSZ - SizeOfPageHeaderData) /
+        (TUPLE_SIZE + sizeof(ItemIdData));
+    uint64 *word;
+    int i;
+
+    for (word = (uint64 *) page; word < (uint64 *) (page + BLCKSZ); word++)
+        *word = next_random();
+
+    phdr->pd_lsn.xlogid = 0;
+    phdr->pd_lsn.xrecoff = absblkno;
+    phdr->pd_checksum = 0;
+    phdr->pd_flags = 0;
+    phdr->pd_lower = SizeOfPageHeaderData + ntuples * sizeof(ItemIdData);
+    phdr->pd_upper = BLCKSZ - ntuples * TUPLE_SIZE;
+    phdr->pd_special = BLCKSZ;
+    phdr->pd_pagesize_version = BLCKSZ | PG_PAGE_LAYOUT_VERSION;
+    phdr->pd_prune_xid = 0;
+    for (i = 0; i < ntuples; i++)
+    {
+        phdr->pd_linp[i].lp_off = BLCKSZ - (i + 1) * TUPLE_SIZE;
+        phdr->pd_linp[i].lp_flags = 1;  /* LP_NORMAL */
+        phdr->pd_linp[i].lp_len = TUPLE_SIZE;
+    }
+
+    phdr->pd_checksum = pg_checksum_page(page, absblkno);
+}
+
+static void
+corrupt_page(char *page, BlockNumber absblkno)
+{
+    /* flip bits past the header until the checksum no longer matches */
+    PageHeader phdr = (PageHeader) page;
+    uint16 checksum = phdr->pd_checksum;
+    size_t offset;
+
+    do
+    {
+        offset = SizeOfPageHeaderData +
+            next_random() % (BLCKSZ - SizeOfPageHeaderData);
+        page[offset] ^= 1 << (next_random() % 8);
+    } while (pg_checksum_page(page, absblkno) == checksum);
+}
+
+static void
+write_segment(const char *path, BlockNumber startblk, BlockNumber nblocks)
+{
+    static char buffer[WRITE_PAGES * BLCKSZ];
+    BlockNumber blkno;
+    BlockNumber batch;
+    BlockNumber i;
+    ssize_t nwritten;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: cannot create %s: %s\n", path,
+            strerror(errno));
+        exit(1);
+    }
+
+    for (blkno = 0; blkno < nblocks; blkno += batch)
+    {
+        batch = nblocks - blkno < WRITE_PAGES ? nblocks - blkno : WRITE_PAGES;
+        for (i = 0; i < batch; i++)
+        {
+            char *page = buffer + (size_t) i * BLCKSZ;
+
+            fill_page(page, startblk + blkno + i);
+            if (corrupt_rate > 0 &&
+                (next_random() >> 11) * (1.0 / 9007199254740992.0) <
+                    corrupt_rate)
+            {
+                corrupt_page(page, startblk + blkno + i);
+                pages_corrupted++;
+            }
+        }
+
+        nwritten = write(fd, buffer, (size_t) batch * BLCKSZ);
+        if (nwritten != (ssize_t) batch * BLCKSZ)
+        {
+            fprintf(stderr, "ERROR: cannot write %s: %s\n", path,
+                nwritten < 0 ? strerror(errno) : "short write");
+            exit(1);
+        }
+        pages_written += batch;
+    }
+
+    if (close(fd) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot close %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    files_written++;
+}
+
+static void
+format_path(char *path, const char *format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(path, MAXPGPATH, format, args);
+    va_end(args);
+    if (len < 0 || len >= MAXPGPATH)
+    {
+        fprintf(stderr, "ERROR: path too long in %s\n", format);
+        exit(1);
+    }
+}
+
+static void
+write_relation(const char *dbdir, Oid relfilenode)
+{
+    /* relations larger than a segment continue in <relfilenode>.1 and on */
+    char path[MAXPGPATH];
+    uint64 blkno;
+    uint64 nblocks;
+    int segno = 0;
+
+    for (blkno = 0; blkno < relation_pages; blkno += nblocks, segno++)
+    {
+        nblocks = relation_pages - blkno < RELSEG_SIZE ?
+            relation_pages - blkno : RELSEG_SIZE;
+        if (segno == 0)
+            format_path(path, "%s/%u", dbdir, relfilenode);
+        else
+            format_path(path, "%s/%u.%d", dbdir, relfilenode, segno);
+        write_segment(path, blkno, nblocks);
+    }
+}
+
+static void
+make_directory(const char *path)
+{
+    if (mkdir(path, 0700) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "ERROR: cannot create directory %s: %s\n", path,
+            strerror(errno));
+        exit(1);
+    }
+}
+
+static void
+write_control_file(const char *datadir)
+{
+    /* Only the fields pg_page_verification reads are filled in, the file
+     * has no valid CRC and cannot be used to start a server.
+     */
+    ControlFileData control;
+    char path[MAXPGPATH];
+    int fd;
+
+    memset(&control, 0, sizeof(control));
+    control.pg_control_version = PG_CONTROL_VERSION;
+    control.blcksz = BLCKSZ;
+    control.relseg_size = RELSEG_SIZE;
+    control.data_checksum_version = PG_DATA_CHECKSUM_VERSION;
+
+    format_path(path, "%s/global", datadir);
+    make_directory(path);
+    format_path(path, "%s/global/pg_control", datadir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, &control, sizeof(control)) != sizeof(control) ||
+        close(fd) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void
+print_help(const char *argv_value)
+{
+    printf("Usage: %s [OPTIONS] -D directory\n", argv_value);
+    printf("  -D directory              data directory to generate\n");
+    printf("  -n, --databases=N         number of databases (default 2)\n");
+    printf("  -r, --relations=N         relations per database (default 4)\n");
+    printf("  -s, --relation-size=MB    size of each relation (default 64)\n");
+    printf("  -c, --corrupt=RATE        corrupt a RATE fraction of the\n");
+    printf("                            pages, e.g. 0.001 (default 0)\n");
+    printf("  -S, --seed=SEED           seed of the page contents and of\n");
+    printf("                            the corrupted pages (default 1)\n");
+    printf("  -h, --help                print this help and exit\n");
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c;
+    int db, rel;
+    char *datadir = NULL;
+    char dir[MAXPGPATH];
+    char *end;
+    const char *short_opt = "c:D:hn:r:s:S:";
+    struct option long_opt[] =
+    {
+        {"corrupt",       required_argument, NULL, 'c'},
+        {"databases",     required_argument, NULL, 'n'},
+        {"datadir",       required_argument, NULL, 'D'},
+        {"help",          no_argument,       NULL, 'h'},
+        {"relation-size", required_argument, NULL, 's'},
+        {"relations",     required_argument, NULL, 'r'},
+        {"seed",          required_argument, NULL, 'S'},
+        {NULL,            0,                 NULL, 0}
+    };
+
+    if (argc < 2)
+    {
+        print_help(argv[0]);
+        exit(1);
+    }
+
+    while ((c = getopt_long(argc, argv, short_opt, long_opt, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'c':
+                corrupt_rate = strtod(optarg, &end);
+                if (*end != '\0' || corrupt_rate < 0 || corrupt_rate > 1)
+                {
+                    fprintf(stderr, "ERROR: invalid corruption rate %s, "
+                        "expected a fraction from 0 to 1\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'D':
+                datadir = optarg;
+                break;
+
+            case 'n':
+                num_databases = atoi(optarg);
+                if (num_databases < 1)
+                {
+                    fprintf(stderr, "ERROR: invalid number of databases %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'r':
+                num_relations = atoi(optarg);
+                if (num_relations < 1)
+                {
+                    fprintf(stderr, "ERROR: invalid number of relations %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
+
+            case 's':
+                relation_pages = strtoull(optarg, &end, 10) * 1024 * 1024 /
+                    BLCKSZ;
+                if (*end != '\0' || relation_pages == 0)
+                {
+                    fprintf(stderr, "ERROR: invalid relation size %s\n",
+                        optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'S':
+                seed = strtoull(optarg, &end, 10);
+                if (*end != '\0')
+                {
+                    fprintf(stderr, "ERROR: invalid seed %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'h':
+                print_help(argv[0]);
+                exit(0);
+
+            default:
+                print_help(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (datadir == NULL)
+    {
+        fprintf(stderr, "ERROR: -D is required\n");
+        exit(1);
+    }
+
+    make_directory(datadir);
+    write_control_file(datadir);
+    format_path(dir, "%s/base", datadir);
+    make_directory(dir);
+    for (db = 0; db < num_databases; db++)
+    {
+        format_path(dir, "%s/base/%d", datadir, FIRST_OID + db);
+        make_directory(dir);
+        for (rel = 0; rel < num_relations; rel++)
+            write_relation(dir, FIRST_OID + num_databases + rel);
+    }
+
+    printf("GENERATED: %llu files, %llu pages, %.1f MB, "
+        "%llu corrupt pages\n",
+        (unsigned long long) files_written,
+        (unsigned long long) pages_written,
+        pages_written * (BLCKSZ / (1024.0 * 1024.0)),
+        (unsigned long long) pages_corrupted);
+    exit(0);
+}
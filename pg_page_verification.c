@@ -19,11 +19,16 @@
  *
  */
 
+/* needed for O_DIRECT */
+#define _GNU_SOURCE
+
 /* standard header files */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
 
 /* headers for directory scanning */
 #include <string.h>
@@ -31,17 +36,485 @@
 #include <dirent.h>
 #include <stddef.h>
 
+/* headers for page cache control and mapped scans */
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+/* headers for --stats and --sample */
+#include <time.h>
+#include <math.h>
+
+/* headers for --url-list */
+#include <netdb.h>
+#include <sys/socket.h>
+#include <strings.h>
+
+/* headers for --numa, and the raw system calls of io_uring */
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#endif
+
+/* decompressors for --tar, each enabled with its make variable */
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+
 /* postgres specific header files */
 #include "c.h"
 #include "pg_config.h"
 #include "storage/checksum_impl.h"
 #include "storage/bufpage.h"
+#include "catalog/pg_control.h"
+#include "catalog/catversion.h"
+
+/* common/relpath.h has it since 12, catalog/catalog.h before */
+#ifndef TABLESPACE_VERSION_DIRECTORY
+#define TABLESPACE_VERSION_DIRECTORY "PG_" PG_MAJORVERSION "_" \
+    CppAsString2(CATALOG_VERSION_NO)
+#endif
+
+/* Segment files larger than this many blocks are split into several tasks
+ * when scanning with more than one worker, 16384 blocks is 128MB with the
+ * default 8KB page size.
+ */
+#define SCAN_TASK_BLOCKS 16384
+
+/* Smaller segment files are scanned in batches of up to this many files,
+ * and of at most SCAN_TASK_BLOCKS blocks or an eighth of the share of each
+ * worker, see schedule_plan().
+ */
+#define SCAN_BATCH_FILES 64
+#define SCAN_BATCHES_PER_WORKER 8
+
+/* Default and maximum size of the read buffer, each read() fills as much of
+ * it as possible and the pages are then verified one page_size slice at a
+ * time.  Buffers are aligned to READ_BUFFER_ALIGN to suit the kernel and
+ * the storage it reads from.
+ */
+#define DEFAULT_READ_BUFFER_SIZE (1024 * 1024)
+#define MAX_READ_BUFFER_SIZE (64 * 1024 * 1024)
+#define READ_BUFFER_ALIGN 4096
+
+/* Default and maximum number of reads kept in flight per worker by the
+ * io_uring backend, each one read_buffer_size bytes.
+ */
+#define DEFAULT_IO_DEPTH 8
+#define MAX_IO_DEPTH 128
 
-#define MAX_DIR_LENGTH 256
+/* With --fadvise pages are dropped from the page cache in steps aligned to
+ * this, the largest folio the page cache uses for file data.
+ */
+#define DROP_CACHE_ALIGN (2 * 1024 * 1024)
+
+/* Number of pages checksummed per call of the checksum kernel */
+#define CHECKSUM_BATCH 16
+/* --recheck reads a page that failed at most this many times more, each
+ * read covering at least one O_DIRECT aligned block
+ */
+#define RECHECK_READS 3
+#define RECHECK_SPAN \
+    (page_size > READ_BUFFER_ALIGN ? page_size : READ_BUFFER_ALIGN)
+
+/* Page sizes postgres can be configured with, see --with-blocksize */
+#define MIN_BLCKSZ 1024
+#define MAX_BLCKSZ 32768
+
+/* Page size and blocks per segment file of the cluster, read from its
+ * pg_control and defaulting to those of the headers built against or to
+ * --block-size and --segment-blocks.
+ */
+static uint32 page_size = BLCKSZ;
+static BlockNumber segment_blocks = RELSEG_SIZE;
+static int page_size_set = 0;
+static int segment_blocks_set = 0;
 
 /* global flag values */
 int verbose = 0;
-int dump_corrupted = 0;
+const char *dump_dir = NULL;    /* -c, images of corrupt pages go here */
+const char *report_file = NULL; /* --report, - is stdout */
+int num_workers = 1;
+size_t read_buffer_size = DEFAULT_READ_BUFFER_SIZE;
+int use_io_uring = 0;
+unsigned io_depth = DEFAULT_IO_DEPTH;
+int direct_io = 0;
+int fadvise_cache = 0;
+int use_mmap = 0;
+int force_full = 0;
+int show_stats = 0;
+int check_headers = 0;          /* --check-headers, see check_page_headers() */
+unsigned recheck_delay = 0;     /* --recheck, ms, see recheck_pages() */
+const char *digest_file = NULL; /* --digests, see write_digests() */
+const char *compare_file = NULL; /* --compare-digests */
+static bool keep_records = false; /* FileRecords for any of the above */
+static int checksums_disabled = 0;  /* according to pg_control */
+const char *metrics_file = NULL; /* --metrics, rewritten while scanning */
+static int measure_times = 0;    /* with --stats or --metrics */
+double max_rate = 0;            /* MB/s, 0 is unlimited */
+double max_iops = 0;            /* reads per second, 0 is unlimited */
+double sample_percent = 0;      /* --sample, 0 verifies every page */
+unsigned sample_pages = 0;      /* --sample-pages, per segment file */
+uint64 sample_seed = 0;
+int sample_seed_set = 0;
+
+/* Targeted verification, see scan_targets().  Block numbers are relative
+ * to the relation as in server error messages, not to a segment file, and
+ * target_endblk is exclusive.
+ */
+Oid target_relfilenode = InvalidOid;
+Oid target_database = InvalidOid;
+int target_database_set = 0;
+long target_segment = -1;
+BlockNumber target_startblk = 0;
+BlockNumber target_endblk = InvalidBlockNumber;
+
+/* --tar, a tar archive such as base.tar of pg_basebackup, - is stdin */
+const char *tar_file = NULL;
+
+/* --url-list of segment files in object storage, and the --http-header
+ * lines sent with every request, each ending in CRLF
+ */
+const char *url_list = NULL;
+static char *http_headers = NULL;
+static bool http_host_set = false;
+
+/* --numa, spread, device or a node number, see plan_numa_placement() */
+const char *numa_mode = NULL;
+
+/* --daemon and --pass-days, see run_daemon() */
+const char *cursor_file = NULL;
+double pass_days = 0;
+static volatile sig_atomic_t daemon_stop = 0;
+
+/* --max-corrupt, 1 with --fail-fast, 0 verifies everything.  Corrupt
+ * pages are counted as they are found, see count_corruption(), and once
+ * there are this many scan_stop has every thread wind down: reads stop
+ * being issued, the walk ends and queued work is dropped.
+ */
+uint64 max_corrupt = 0;
+static uint64 corruption_seen = 0;
+static int scan_stop = 0;
+
+/* Token buckets behind --max-rate and --max-iops, shared by all workers.
+ * A read takes its tokens up front, possibly going into debt, and the
+ * reader then sleeps until the debt would be paid back, so every read is
+ * admitted in arrival order and the long term rate never exceeds the
+ * limit.  Up to THROTTLE_BURST_SEC worth of unused tokens are kept.
+ */
+#define THROTTLE_BURST_SEC 0.1
+
+static struct
+{
+    pthread_mutex_t lock;
+    double          bytes;      /* available tokens, negative when in debt */
+    double          ops;
+    uint64          last_ns;
+} throttle = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+const char *manifest_file = NULL;
+
+/* Where a scan of a mapped segment continues if the file shrinks under it
+ * and touching the mapping raises SIGBUS, NULL outside of mapped scans.
+ */
+static __thread sigjmp_buf *mmap_fault_jmp = NULL;
+
+/* Pages in the segment files a sampling scan picked its pages from, the
+ * pages actually verified are counted in scan_stats.totals.pages.
+ */
+static uint64 sample_population = 0;
+
+/* size of an OS page, the unit the page cache is managed in */
+static size_t os_page_size;
+
+/* set once the fallback from O_DIRECT has been reported */
+static int direct_io_warned = 0;
+
+/* Counters behind --stats and --metrics.  Every scanning thread keeps its
+ * own in ScanIO, so the hot path only does plain adds; times are only
+ * measured with --stats or --metrics.  read_ns is the time spent waiting
+ * for reads, with --mmap the page faults fall into checksum_ns instead.
+ * The histograms count reads and checksum batches by their time, bucket i
+ * holding those up to 2^i microseconds and the last one all longer ones.
+ */
+#define LATENCY_BUCKETS 24
+
+typedef struct ScanStats
+{
+    uint64      bytes_read;
+    uint64      pages;
+    uint64      files;
+    uint64      corrupt_pages;
+    uint64      new_pages;      /* all zero, counted with --check-headers */
+    uint64      empty_pages;    /* initialized, without line pointers */
+    uint64      bad_headers;    /* with a valid checksum but not header */
+    uint64      torn_pages;     /* verified when read again, --recheck */
+    uint64      read_ns;
+    uint64      checksum_ns;
+    uint64      read_hist[LATENCY_BUCKETS];
+    uint64      checksum_hist[LATENCY_BUCKETS];
+} ScanStats;
+
+/* The metrics thread reads the counters of the scanning threads while they
+ * run.  Only the owning thread writes them, so a relaxed atomic store of
+ * the new value, a plain store on the targets supported, is enough.
+ */
+#define STATS_ADD(counter, value) \
+    __atomic_store_n(&(counter), (counter) + (value), __ATOMIC_RELAXED)
+
+/* Totals of one database directory, each scanned range adds to them
+ * atomically once it is done.
+ */
+typedef struct DatabaseStats
+{
+    struct DatabaseStats *next;
+    ScanStats   totals;
+    char        path[1];        /* relative to the data directory */
+} DatabaseStats;
+
+static struct
+{
+    uint64          dirs;
+    uint64          files;
+    uint64          walk_ns;    /* in open(), readdir() and fstatat() */
+    ScanStats       totals;     /* of all scanning threads */
+    DatabaseStats  *databases;
+    DatabaseStats **last;
+} scan_stats;
+
+#ifdef USE_IO_URING
+/* A ring set up with the raw system calls, liburing is not needed */
+typedef struct UringReader
+{
+    int                  fd;
+    unsigned             to_submit;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ptr;
+    void                *cq_ptr;
+    size_t               sq_len;
+    size_t               cq_len;
+    size_t               sqes_len;
+} UringReader;
+#endif
+
+/* I/O state owned by one scanning thread.  buffer holds read_buffer_size
+ * bytes for blocking reads, or io_depth such buffers when reads go through
+ * io_uring.  drop_cache is set while the current file is read through the
+ * page cache with --fadvise, resident then has one entry per OS page of the
+ * range being read, starting at resident_base, recording which pages were
+ * cached before the scan read them.  Pages before drop_from have already
+ * been dropped.  digest sums page_digest() over the pages of the range
+ * being scanned, stats are the --stats counters of the thread.  Every
+ * ScanIO in use is on the list of the metrics writer.
+ */
+typedef struct ScanIO
+{
+    struct ScanIO *next_io;     /* in the list read by --metrics */
+    int            worker;
+    char          *buffer;
+    char          *recheck;     /* two images of a page read again */
+    uint64         digest;
+    uint64         counted;     /* by count_corruption() in the range */
+    BlockNumber    verified;    /* blocks before it are, --mmap */
+    bool           mapped;      /* verify_buffer() reads a mapping */
+    ScanStats      stats;
+    bool           drop_cache;
+    unsigned char *resident;
+    size_t         resident_size;
+    size_t         resident_pages;
+    off_t          resident_base;
+    off_t          drop_from;
+#ifdef USE_IO_URING
+    UringReader *uring;
+#endif
+} ScanIO;
+
+/* I/O state of the serial scan, workers each have their own */
+static ScanIO scan_io;
+
+/* Manifest entry of one segment file.  Entries of the previous run are
+ * compared against the file's metadata to skip unchanged files, entries of
+ * this run are filled in by whichever workers scan the file's ranges, so
+ * digest and corrupted are only updated atomically.  digest combines the
+ * checksums of all pages of the file, see page_digest().
+ */
+typedef struct FileRecord
+{
+    char           *path;       /* relative to the data directory */
+    off_t           size;
+    struct timespec mtime;
+    ino_t           inode;
+    uint64          digest;
+    uint64          corrupted;
+} FileRecord;
+
+static struct
+{
+    FileRecord    **slots;      /* hash table of the previous manifest */
+    size_t          nslots;
+    FileRecord    **records;    /* segment files of this run, in walk order */
+    size_t          nrecords;
+    size_t          maxrecords;
+    size_t          skipped;
+    size_t          prefix_len; /* length of the data directory in paths */
+} manifest;
+
+/* Everything about the segment file being scanned that stays the same for
+ * all of its pages, worked out once per file (or block range of a file)
+ * instead of once per page.  Block numbers used for checksums need to be
+ * absolute so that subsequent segment files have the blkno calculated based
+ * on all segment files and not relative to the current segment file, see:
+ * https://goo.gl/qRTn46.  segmentBlockOffset is the absolute block number of
+ * the first block of the file.
+ */
+typedef struct SegmentFile
+{
+    const char     *filename;
+    const char     *dirpath;
+    const char     *url;            /* read over HTTP, see --url-list */
+    int             fd;             /* for re-reads with --recheck, or -1 */
+    unsigned int    segmentNumber;
+    BlockNumber     segmentBlockOffset;
+    FileRecord     *record;
+    DatabaseStats  *db;
+} SegmentFile;
+
+/* A data directory given with -D or --datadir-list.  Several of them are
+ * verified one after the other by the serial scan, or all through the one
+ * worker pool and --max-rate budget with --jobs, and get a result each.
+ */
+typedef struct Cluster
+{
+    char       *datadir;
+    const char *version_dir;    /* its directory in each tablespace */
+    uint64      corrupted;      /* updated atomically by the workers */
+} Cluster;
+
+static Cluster *clusters = NULL;
+static int num_clusters = 0;
+
+/* the cluster whose files this thread is scanning */
+static __thread Cluster *current_cluster = NULL;
+
+/* A unit of work for the parallel scan: a block range [startblk, endblk) of
+ * one segment file, or a directory to walk if filename is NULL.  dirpath,
+ * filename and url point into the same allocation as the task itself so
+ * that a task is freed with a single free().
+ */
+typedef struct ScanTask
+{
+    Cluster    *cluster;
+    const char *dirpath;
+    const char *filename;
+    const char *url;
+    BlockNumber startblk;
+    BlockNumber endblk;
+    FileRecord *record;
+    DatabaseStats *db;
+    BlockNumber nblocks;        /* expected, with the batch behind it */
+    struct ScanTask *next;      /* in a batch of small segment files */
+} ScanTask;
+
+/* Per worker double ended queue.  The owning worker pushes and pops at the
+ * tail, idle workers steal from the head so that they take the oldest work
+ * and contend as little as possible with the owner.
+ */
+typedef struct TaskDeque
+{
+    pthread_mutex_t lock;
+    ScanTask      **tasks;
+    size_t          head;
+    size_t          tail;
+    size_t          capacity;
+} TaskDeque;
+
+typedef struct ScanWorker
+{
+    pthread_t   thread;
+    int         id;
+    int         cpu;            /* pinned to with --numa, or -1 */
+    int         node;
+    TaskDeque   queue;
+    ScanIO      io;
+    uint64      corrupted;
+} ScanWorker;
+
+/* Shared state of the worker pool.  queued is the number of tasks sitting
+ * in any of the deques and active the number being worked on, which may
+ * queue more; idle workers sleep on wakeup until either work arrives or
+ * the walk is done and no task is left anywhere, and idle is signaled
+ * whenever the pool runs out of work.  The walk only queues directories,
+ * the segment files found are gathered in planned and handed out through
+ * plan once the walk is over, see schedule_plan().
+ */
+static struct
+{
+    ScanWorker     *workers;
+    int             next_worker;
+    size_t          queued;
+    size_t          active;
+    bool            walk_done;
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;
+    pthread_cond_t  idle;
+    ScanTask      **planned;
+    size_t          nplanned;
+    size_t          planned_capacity;
+    TaskDeque       plan;
+} pool;
+
+/* the worker running on this thread, NULL on the main thread */
+static __thread ScanWorker *current_worker = NULL;
+
+/* Serializes the bookkeeping of directory walks, which with several workers
+ * run on all of them: the manifest records and the list of DatabaseStats.
+ */
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+psprintf(const char *format, ...)
+{
+    /* Formats into a string allocated to fit, mostly to build paths, which
+     * have no useful upper bound in a cluster with deep tablespace
+     * locations.  The caller frees the result.
+     */
+    va_list args;
+    char *result;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    result = len < 0 ? NULL : malloc(len + 1);
+    if (result == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory formatting %s\n", format);
+        exit(1);
+    }
+    va_start(args, format);
+    vsnprintf(result, len + 1, format, args);
+    va_end(args);
+
+    return result;
+}
 
 static unsigned int
 parse_segment_number(const char* filename)
@@ -61,262 +534,6491 @@ parse_segment_number(const char* filename)
     return atoi(&filename[segmentnumber + 1]);
 }
 
+/* Multi-page checksum kernels.
+ *
+ * pg_checksum_page() computes N_SUMS interleaved FNV-1a style sums over the
+ * page, each sum covering every N_SUMS'th uint32.  With N_SUMS at 32 a row of
+ * the page is exactly 4 AVX2, 2 AVX-512 or 8 NEON vectors, so the sums map
+ * directly onto vector lanes.  The multiply has a long latency, so the
+ * kernels checksum several pages at once to keep independent chains in
+ * flight.  pd_checksum is cleared in a copy of the first row instead of in
+ * the page itself, the page is never written.  All kernels produce exactly
+ * the result of pg_checksum_page(), which select_checksum_kernel() checks
+ * before a kernel is used.
+ *
+ * The kernels take the page size as an argument and are always inlined into
+ * one variant per block size postgres can be built with, so that each
+ * variant loops over a constant number of rows.  select_checksum_kernel()
+ * picks the variants for the page size of the cluster.
+ */
 
-static bool
-is_page_corrupted(const char *page, BlockNumber blkno, const char *filename,
-    const char *dirpath)
-{
-    /* Function checks a page header checksum value aginst the current
-     * checksum value of a page.  NewPage checksums will be zero until they
-     * are set.  There is a similar function PageIsVerified responsible for
-     * checking pages before they are loaded into buffer pool.
-     *  see:  src/backend/storage/page/bufpage.c
-     *
-     * Consider returning a negative value if page is new or checksum unset
-     * or if more detail for a page verifiction can be found.
-     */
+#define CHECKSUM_ROWS(blcksz) ((blcksz) / (sizeof(uint32) * N_SUMS))
 
-    PageHeader phdr = (PageHeader)page;
+typedef void (*checksum_pages_fn) (const char *pages, int npages,
+    BlockNumber blkno, uint16 *checksums);
 
-    /* calculating blkno needs to be aboslute so that subsequent segment files
-    *  have the blkno calculated based on all segment files and not relative to
-    *  the current segment file. see: https://goo.gl/qRTn46
-    */
+#define CHECKSUM_VARIANT(kernel, attributes, kb) \
+attributes static void \
+kernel##_##kb##k(const char *pages, int npages, BlockNumber blkno, \
+    uint16 *checksums) \
+{ \
+    kernel(pages, npages, blkno, checksums, kb * 1024); \
+}
 
-    /* Segment size in bytes, BLCKSZ is 8192 by default, 8KB pages
-    *  1GB segment files are 131072 blocks of 8KB page size
-    *  NOTE: pd_pagesize_version is BLCKSZ + version, since 8.3+, version is 4, 
-    *   resulting in pd_pagesize_version being 8196 when pagesize is 8KB
-    */
-    static unsigned int segmentSize = RELSEG_SIZE * BLCKSZ;
+/* one variant of kernel for each size from MIN_BLCKSZ to MAX_BLCKSZ */
+#define CHECKSUM_VARIANTS(kernel, attributes) \
+    CHECKSUM_VARIANT(kernel, attributes, 1) \
+    CHECKSUM_VARIANT(kernel, attributes, 2) \
+    CHECKSUM_VARIANT(kernel, attributes, 4) \
+    CHECKSUM_VARIANT(kernel, attributes, 8) \
+    CHECKSUM_VARIANT(kernel, attributes, 16) \
+    CHECKSUM_VARIANT(kernel, attributes, 32)
 
-    /* Number of current segment */
-    static unsigned int segmentNumber = 0;
+#define CHECKSUM_VARIANT_TABLE(kernel) \
+    { kernel##_1k, kernel##_2k, kernel##_4k, kernel##_8k, kernel##_16k, \
+      kernel##_32k }
 
-    segmentNumber = parse_segment_number(filename);
+static uint16
+checksum_finish(uint32 result, BlockNumber blkno)
+{
+    /* same mixing in of the block number and reduction as pg_checksum_page */
+    result ^= blkno;
+    return (uint16) ((result % 65535) + 1);
+}
 
-    /* segmentBlockOffset is the absolute blockNumber of the block when taking
-     * into account any previous segment files.
-    */
-    uint32 segmentBlockOffset = RELSEG_SIZE * segmentNumber;
-    
-    uint16 checksum = pg_checksum_page((char *)page, segmentBlockOffset + blkno);
+static void
+checksum_first_row(const char *page, uint32 *row)
+{
+    memcpy(row, page, sizeof(uint32) * N_SUMS);
+    memset((char *) row + offsetof(PageHeaderData, pd_checksum), 0,
+        sizeof(uint16));
+}
 
-    bool corrupted = false;
+__attribute__((always_inline))
+static inline void
+checksum_pages_scalar(const char *pages, int npages, BlockNumber blkno,
+    uint16 *checksums, const uint32 blcksz)
+{
+    uint32 row0[N_SUMS];
+    uint32 sums[N_SUMS];
+    const uint32 *data;
+    uint32 result;
+    uint32 i, j;
+    int p;
 
-    if (verbose)
+    for (p = 0; p < npages; p++)
     {
-        printf("FILENAME: %s\n", filename);
+        data = (const uint32 *) (pages + (size_t) p * blcksz);
+        checksum_first_row((const char *) data, row0);
+        memcpy(sums, checksumBaseOffsets, sizeof(checksumBaseOffsets));
+
+        for (j = 0; j < N_SUMS; j++)
+            CHECKSUM_COMP(sums[j], row0[j]);
+        for (i = 1; i < CHECKSUM_ROWS(blcksz); i++)
+            for (j = 0; j < N_SUMS; j++)
+                CHECKSUM_COMP(sums[j], data[i * N_SUMS + j]);
+        for (i = 0; i < 2; i++)
+            for (j = 0; j < N_SUMS; j++)
+                CHECKSUM_COMP(sums[j], 0);
 
-        printf("DEBUG: filename: %s/%s[%d]\n \
-            \tsegmentBlockOffset: %d, maxSegmentSize: %d,\n \
-            \tsegmentNumber: %d, relative blkno: %d, absolute blkno: %d,\n \
-            \tchecksum: %x, phdr->pd_checksum: %x,\n \
-            \tphdr->pd_flags: %d, phdr->pd_lower: %d, phdr->pd_upper: %d,\n \
-            \tphdr->pd_special: %d, phdr->pd_pagesize_version: %d,\n \
-            \tphdr->pd_prune_xid: %d\n",
-            dirpath, filename, blkno,
-            segmentBlockOffset, segmentSize,
-            segmentNumber, blkno, segmentBlockOffset + blkno,
-            checksum, phdr->pd_checksum,
-            phdr->pd_flags, phdr->pd_lower, phdr->pd_upper,
-            phdr->pd_special, phdr->pd_pagesize_version,
-            phdr->pd_prune_xid );
+        result = 0;
+        for (j = 0; j < N_SUMS; j++)
+            result ^= sums[j];
+        checksums[p] = checksum_finish(result, blkno + p);
     }
+}
+
+CHECKSUM_VARIANTS(checksum_pages_scalar, )
+
+static void
+checksum_pages_reference(const char *pages, int npages, BlockNumber blkno,
+    uint16 *checksums)
+{
+    /* pg_checksum_page() itself, it clears pd_checksum in the page while
+     * computing so it needs a writable copy.  It is only built for the
+     * BLCKSZ of the headers.
+     */
+    char page[BLCKSZ];
+    int p;
 
-    if (phdr->pd_checksum != 0 && phdr->pd_checksum != checksum)
+    for (p = 0; p < npages; p++)
     {
-        corrupted = true;
-        if (verbose)
-            printf("ERROR: corruption found in %s/%s[%d], expected %x, found %x\n",
-                dirpath, filename, blkno, checksum, phdr->pd_checksum);
+        memcpy(page, pages + (size_t) p * BLCKSZ, BLCKSZ);
+        checksums[p] = pg_checksum_page(page, blkno + p);
     }
+}
 
-    if (verbose)
-        printf("DEBUG: is_page_corrupted for %s/%s[%d] returns: %d\n",
-                dirpath, filename, blkno, corrupted);
+#if N_SUMS == 32 && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__GNUC__)
+#define HAVE_X86_CHECKSUM_KERNELS
+#include <immintrin.h>
 
-    return corrupted;
-}
+#define AVX2_COMP(sum, value) \
+do { \
+    __m256i __tmp = _mm256_xor_si256((sum), (value)); \
+    (sum) = _mm256_xor_si256(_mm256_mullo_epi32(__tmp, prime), \
+        _mm256_srli_epi32(__tmp, 17)); \
+} while (0)
 
+__attribute__((target("avx2")))
 static uint32
-scan_segmentfile(const char *filename, const char *dirpath)
+avx2_fold(__m256i *sums)
 {
+    uint32 lanes[8];
+    uint32 result = 0;
+    __m256i folded;
+    int i;
 
-    /* Performance considerations:
-     * segment files can be up to 1GB in size before they are split
-     * https://www.postgresql.org/docs/9.6/static/storage-file-layout.html
-     */
+    folded = _mm256_xor_si256(_mm256_xor_si256(sums[0], sums[1]),
+        _mm256_xor_si256(sums[2], sums[3]));
+    _mm256_storeu_si256((__m256i *) lanes, folded);
+    for (i = 0; i < 8; i++)
+        result ^= lanes[i];
 
-    /* Always skip checking pg_internal.init because always shows as
-     * corrupted.  If this file ever becomes corrupted, OK to remove
-     * it as it is recreated upon server startup. Return false since
-     * zero corrupt pages are checked here.
-     */
-    if (strstr(filename, "pg_internal.init") != NULL)
-        return 0;
-
-    if (verbose)
-        printf("DEBUG: scanning segment filename: %s/%s\n",
-            dirpath, filename);
+    return result;
+}
 
-    int fd;
-    char page[BLCKSZ];
-    BlockNumber blkno = 0;
-    BlockNumber corrupted = 0;
+__attribute__((target("avx2"), always_inline))
+static inline void
+checksum_pages_avx2(const char *pages, int npages, BlockNumber blkno,
+    uint16 *checksums, const uint32 blcksz)
+{
+    /* two pages at a time, eight independent vector chains */
+    const __m256i prime = _mm256_set1_epi32(FNV_PRIME);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32 row0[2][N_SUMS];
+    __m256i a[4];
+    __m256i b[4];
+    const __m256i *pa;
+    const __m256i *pb;
+    uint32 i;
+    int j;
+    int p = 0;
 
-    fd = open(filename, O_RDONLY);
-    if (fd < 0)
+    while (p < npages)
     {
-        fprintf(stderr, "ERROR: %s: %s cannot be opened\n", strerror(errno), filename);
-        /* return 1 so that other segment files can be scanned, but that this
-         * segment file is marked as corrupted/some unknown error
-         */
-        return 1;
+        const char *page_a = pages + (size_t) p * blcksz;
+        const char *page_b = p + 1 < npages ? page_a + blcksz : page_a;
+
+        checksum_first_row(page_a, row0[0]);
+        checksum_first_row(page_b, row0[1]);
+        for (j = 0; j < 4; j++)
+        {
+            a[j] = _mm256_loadu_si256((const __m256i *) checksumBaseOffsets + j);
+            b[j] = a[j];
+            AVX2_COMP(a[j], _mm256_loadu_si256((const __m256i *) row0[0] + j));
+            AVX2_COMP(b[j], _mm256_loadu_si256((const __m256i *) row0[1] + j));
+        }
+
+        for (i = 1; i < CHECKSUM_ROWS(blcksz); i++)
+        {
+            pa = (const __m256i *) (page_a + i * sizeof(uint32) * N_SUMS);
+            pb = (const __m256i *) (page_b + i * sizeof(uint32) * N_SUMS);
+            for (j = 0; j < 4; j++)
+            {
+                AVX2_COMP(a[j], _mm256_loadu_si256(pa + j));
+                AVX2_COMP(b[j], _mm256_loadu_si256(pb + j));
+            }
+        }
+
+        for (i = 0; i < 2; i++)
+            for (j = 0; j < 4; j++)
+            {
+                AVX2_COMP(a[j], zero);
+                AVX2_COMP(b[j], zero);
+            }
+
+        checksums[p] = checksum_finish(avx2_fold(a), blkno + p);
+        if (p + 1 < npages)
+            checksums[p + 1] = checksum_finish(avx2_fold(b), blkno + p + 1);
+        p += 2;
     }
+}
+
+CHECKSUM_VARIANTS(checksum_pages_avx2, __attribute__((target("avx2"))))
+
+#define AVX512_COMP(sum, value) \
+do { \
+    __m512i __tmp = _mm512_xor_si512((sum), (value)); \
+    (sum) = _mm512_xor_si512(_mm512_mullo_epi32(__tmp, prime), \
+        _mm512_srli_epi32(__tmp, 17)); \
+} while (0)
 
-    while (read(fd, page, BLCKSZ) == BLCKSZ)
+__attribute__((target("avx512f"), always_inline))
+static inline void
+checksum_pages_avx512(const char *pages, int npages, BlockNumber blkno,
+    uint16 *checksums, const uint32 blcksz)
+{
+    /* four pages at a time, eight independent vector chains */
+    const __m512i prime = _mm512_set1_epi32(FNV_PRIME);
+    const __m512i zero = _mm512_setzero_si512();
+    uint32 row0[4][N_SUMS];
+    uint32 lanes[16];
+    const char *page[4];
+    __m512i s[4][2];
+    const __m512i *row;
+    uint32 result;
+    uint32 i;
+    int j, k;
+    int p = 0;
+
+    while (p < npages)
     {
-        if (is_page_corrupted(page, blkno, filename, dirpath))
+        for (k = 0; k < 4; k++)
         {
-            corrupted++;
+            page[k] = pages + (size_t) (p + k < npages ? p + k : p) * blcksz;
+            checksum_first_row(page[k], row0[k]);
+            for (j = 0; j < 2; j++)
+            {
+                s[k][j] = _mm512_loadu_si512(
+                    (const __m512i *) checksumBaseOffsets + j);
+                AVX512_COMP(s[k][j],
+                    _mm512_loadu_si512((const __m512i *) row0[k] + j));
+            }
         }
-        blkno++;
-    }
-    close(fd);
 
-    return corrupted;
+        for (i = 1; i < CHECKSUM_ROWS(blcksz); i++)
+            for (k = 0; k < 4; k++)
+            {
+                row = (const __m512i *) (page[k] + i * sizeof(uint32) * N_SUMS);
+                for (j = 0; j < 2; j++)
+                    AVX512_COMP(s[k][j], _mm512_loadu_si512(row + j));
+            }
+
+        for (k = 0; k < 4 && p + k < npages; k++)
+        {
+            for (i = 0; i < 2; i++)
+                for (j = 0; j < 2; j++)
+                    AVX512_COMP(s[k][j], zero);
+
+            _mm512_storeu_si512((__m512i *) lanes,
+                _mm512_xor_si512(s[k][0], s[k][1]));
+            result = 0;
+            for (j = 0; j < 16; j++)
+                result ^= lanes[j];
+            checksums[p + k] = checksum_finish(result, blkno + p + k);
+        }
+        p += 4;
+    }
 }
 
-static uint32
-scan_directory(const char *dirpath)
-{
-    /* scope is only to check the base directory, where the actual data files
-     * are located.  Other directories contain temporary files used for
-     * transactions or queries in progress and should not be checked.
-     *
-     * Postgres stores data files in one directory per database defined,
-     * without additional nesting or leafs.  This causes depth of database
-     * directories to always be one.
-     */
+CHECKSUM_VARIANTS(checksum_pages_avx512, __attribute__((target("avx512f"))))
+#endif   /* HAVE_X86_CHECKSUM_KERNELS */
 
-    DIR *d;
-    struct dirent *dir;
-    struct stat statbuf;
-    uint32 corrupt_pages_found = 0;
+#if N_SUMS == 32 && defined(__aarch64__)
+#define HAVE_NEON_CHECKSUM_KERNEL
+#include <arm_neon.h>
 
-    d = opendir(dirpath);
+#define NEON_COMP(sum, value) \
+do { \
+    uint32x4_t __tmp = veorq_u32((sum), (value)); \
+    (sum) = veorq_u32(vmulq_u32(__tmp, prime), vshrq_n_u32(__tmp, 17)); \
+} while (0)
 
-    if (verbose)
-        printf("DEBUG: called scan_directory(%s)\n", dirpath);
+__attribute__((always_inline))
+static inline void
+checksum_pages_neon(const char *pages, int npages, BlockNumber blkno,
+    uint16 *checksums, const uint32 blcksz)
+{
+    /* NEON is always there on aarch64, two pages at a time */
+    const uint32x4_t prime = vdupq_n_u32(FNV_PRIME);
+    const uint32x4_t zero = vdupq_n_u32(0);
+    uint32 row0[2][N_SUMS];
+    uint32x4_t a[8];
+    uint32x4_t b[8];
+    const uint32 *ra;
+    const uint32 *rb;
+    uint32 i;
+    int j;
+    int p = 0;
 
-    if (d)
+    while (p < npages)
     {
-        chdir(dirpath);
-        while ((dir = readdir(d)) != NULL)
-        {
-            lstat(dir->d_name, &statbuf);
+        const char *page_a = pages + (size_t) p * blcksz;
+        const char *page_b = p + 1 < npages ? page_a + blcksz : page_a;
 
-            if (verbose)
-                printf("DEBUG: direntry: %s/%s - statbuf.st_mode: %d\n",
-                    dirpath, dir->d_name, statbuf.st_mode);
+        checksum_first_row(page_a, row0[0]);
+        checksum_first_row(page_b, row0[1]);
+        for (j = 0; j < 8; j++)
+        {
+            a[j] = vld1q_u32(checksumBaseOffsets + j * 4);
+            b[j] = a[j];
+            NEON_COMP(a[j], vld1q_u32(row0[0] + j * 4));
+            NEON_COMP(b[j], vld1q_u32(row0[1] + j * 4));
+        }
 
-            if (S_ISDIR(statbuf.st_mode))
+        for (i = 1; i < CHECKSUM_ROWS(blcksz); i++)
+        {
+            ra = (const uint32 *) page_a + i * N_SUMS;
+            rb = (const uint32 *) page_b + i * N_SUMS;
+            for (j = 0; j < 8; j++)
             {
-                if(strcmp(".", dir->d_name) == 0 ||
-                    strcmp("..", dir->d_name) == 0)
-                    continue;
-
-                char new_dirpath[MAX_DIR_LENGTH];
-                snprintf(new_dirpath, MAX_DIR_LENGTH, "%s/%s", dirpath, dir->d_name);
-
-                corrupt_pages_found += scan_directory(new_dirpath);
+                NEON_COMP(a[j], vld1q_u32(ra + j * 4));
+                NEON_COMP(b[j], vld1q_u32(rb + j * 4));
             }
-            else if (S_ISREG(statbuf.st_mode))
+        }
+
+        for (i = 0; i < 2; i++)
+            for (j = 0; j < 8; j++)
             {
-                corrupt_pages_found += scan_segmentfile(dir->d_name, dirpath);
+                NEON_COMP(a[j], zero);
+                NEON_COMP(b[j], zero);
             }
+
+        for (j = 1; j < 8; j++)
+        {
+            a[0] = veorq_u32(a[0], a[j]);
+            b[0] = veorq_u32(b[0], b[j]);
         }
-        closedir(d);
+        checksums[p] = checksum_finish(vgetq_lane_u32(a[0], 0) ^
+            vgetq_lane_u32(a[0], 1) ^ vgetq_lane_u32(a[0], 2) ^
+            vgetq_lane_u32(a[0], 3), blkno + p);
+        if (p + 1 < npages)
+            checksums[p + 1] = checksum_finish(vgetq_lane_u32(b[0], 0) ^
+                vgetq_lane_u32(b[0], 1) ^ vgetq_lane_u32(b[0], 2) ^
+                vgetq_lane_u32(b[0], 3), blkno + p + 1);
+        p += 2;
     }
+}
 
-    return corrupt_pages_found;
+CHECKSUM_VARIANTS(checksum_pages_neon, )
+#endif   /* HAVE_NEON_CHECKSUM_KERNEL */
+
+/* variants of the kernels, indexed by log2(page_size / MIN_BLCKSZ) */
+static const checksum_pages_fn checksum_scalar_variants[] =
+    CHECKSUM_VARIANT_TABLE(checksum_pages_scalar);
+#ifdef HAVE_X86_CHECKSUM_KERNELS
+static const checksum_pages_fn checksum_avx2_variants[] =
+    CHECKSUM_VARIANT_TABLE(checksum_pages_avx2);
+static const checksum_pages_fn checksum_avx512_variants[] =
+    CHECKSUM_VARIANT_TABLE(checksum_pages_avx512);
+#endif
+#ifdef HAVE_NEON_CHECKSUM_KERNEL
+static const checksum_pages_fn checksum_neon_variants[] =
+    CHECKSUM_VARIANT_TABLE(checksum_pages_neon);
+#endif
+
+/* kernel used by verify_buffer(), set by select_checksum_kernel() */
+static checksum_pages_fn checksum_pages = checksum_pages_reference;
+
+static bool
+checksum_kernel_matches(checksum_pages_fn kernel, checksum_pages_fn reference,
+    uint32 blcksz)
+{
+    /* compares a kernel against a reference on pseudo random pages of
+     * blcksz bytes, with block numbers chosen to exercise the reduction
+     * modulo 65535
+     */
+    static char pages[CHECKSUM_BATCH * MAX_BLCKSZ];
+    uint16 expected[CHECKSUM_BATCH];
+    uint16 found[CHECKSUM_BATCH];
+    uint32 seed = 0x9E3779B9;
+    size_t i;
+
+    for (i = 0; i < CHECKSUM_BATCH * blcksz / sizeof(uint32); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        ((uint32 *) pages)[i] = seed;
+    }
+
+    reference(pages, CHECKSUM_BATCH, 65530, expected);
+    kernel(pages, CHECKSUM_BATCH, 65530, found);
+
+    return memcmp(expected, found, sizeof(expected)) == 0;
 }
 
-static void
-print_help(const char *argv_value)
+static int
+block_size_class(uint32 blcksz)
 {
-    printf("Usage: %s [OPTIONS]\n", argv_value);
-    printf("  -v                        verbose\n");
-    printf("  -D directory              data directory\n");
-    printf("  -h, --help                print this help and exit\n");
-    printf("\n");
+    int size_class = 0;
+
+    while ((MIN_BLCKSZ << size_class) < blcksz)
+        size_class++;
+
+    return size_class;
 }
 
-int
-main(int argc, char *argv[])
+static void
+select_checksum_kernel(void)
 {
-    /*
-     * Flow is to use a data directory and traverse to find segments, each
-     * segment file is then scanned for corrupt pages.
+    /* pg_checksum_page() is the authority, but it only exists for BLCKSZ.
+     * The scalar kernel is checked against it at BLCKSZ and then serves as
+     * the reference at the page size of the cluster.
      */
+    int size_class = block_size_class(page_size);
+    checksum_pages_fn reference = checksum_scalar_variants[size_class];
+    const char *name = "scalar";
 
-    int c;
-    uint32 corrupted_pages_found = 0;
-    const char *short_opt = "chD:v";
-    char datadir[MAX_DIR_LENGTH];
-    struct stat statbuf;
-    struct option long_opt[] =
+    if (!checksum_kernel_matches(
+            checksum_scalar_variants[block_size_class(BLCKSZ)],
+            checksum_pages_reference, BLCKSZ))
     {
-        {"dumpcorrupted", no_argument,       NULL, 'c'},
-        {"datadir",       required_argument, NULL, 'D'},
-        {"help",          no_argument,       NULL, 'h'},
-        {"verbose",       no_argument,       NULL, 'v'},
-        {NULL,            0,                 NULL, 0  }
-    };
+        /* should never happen */
+        if (page_size != BLCKSZ)
+        {
+            fprintf(stderr, "ERROR: cannot verify %u byte pages, the "
+                "checksum kernel does not match pg_checksum_page()\n",
+                page_size);
+            exit(1);
+        }
+        reference = checksum_pages_reference;
+        name = "pg_checksum_page";
+    }
+    checksum_pages = reference;
 
-    /* if no arguments passed, print help and exit(1) */
-    if (argc == 1)
+#ifdef HAVE_X86_CHECKSUM_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        checksum_kernel_matches(checksum_avx512_variants[size_class],
+            reference, page_size))
     {
-        print_help(argv[0]);
-        exit(1);
+        checksum_pages = checksum_avx512_variants[size_class];
+        name = "avx512";
     }
-
-    while((c = getopt_long(argc, argv, short_opt, long_opt, NULL)) != -1)
+    else if (__builtin_cpu_supports("avx2") &&
+        checksum_kernel_matches(checksum_avx2_variants[size_class],
+            reference, page_size))
     {
-        switch(c)
-        {
+        checksum_pages = checksum_avx2_variants[size_class];
+        name = "avx2";
+    }
+#endif
+#ifdef HAVE_NEON_CHECKSUM_KERNEL
+    if (checksum_kernel_matches(checksum_neon_variants[size_class],
+            reference, page_size))
+    {
+        checksum_pages = checksum_neon_variants[size_class];
+        name = "neon";
+    }
+#endif
+
+    if (verbose)
+        printf("DEBUG: using %s checksum kernel for %u byte pages\n", name,
+            page_size);
+}
+
+
+static bool
+is_page_corrupted(const char *page, uint16 checksum)
+{
+    /* Function checks a page header checksum value aginst the current
+     * checksum value of a page.  NewPage checksums will be zero until they
+     * are set.  There is a similar function PageIsVerified responsible for
+     * checking pages before they are loaded into buffer pool.
+     *  see:  src/backend/storage/page/bufpage.c
+     *
+     * Consider returning a negative value if page is new or checksum unset
+     * or if more detail for a page verifiction can be found.
+     *
+     * checksum is the current checksum of the page, computed by the caller
+     * for a batch of pages with the absolute block number, see SegmentFile.
+     * This runs for every page, so it is kept free of branches; everything
+     * that reports on a page lives in trace_page() and report_page().
+     */
+
+    uint16 stored = ((const PageHeaderData *) page)->pd_checksum;
+
+    return (stored != 0) & (stored != checksum);
+}
+
+/* Corrupt pages are written to --report and -c by a thread of their own,
+ * so that a badly damaged file does not have the scan wait for the disk.
+ * Scanning threads queue an entry per line or page image and only wait
+ * once REPORT_QUEUE_BYTES are queued, which bounds the memory used however
+ * many pages are corrupt.  Consecutive report lines are written together.
+ */
+#define REPORT_QUEUE_BYTES (4 * 1024 * 1024)
+#define REPORT_WRITE_BUFFER (64 * 1024)
+
+typedef struct ReportEntry
+{
+    struct ReportEntry *next;
+    char               *dump_path;  /* page image to write, NULL for a line */
+    size_t              len;
+    char                data[1];
+} ReportEntry;
+
+static struct
+{
+    int             fd;
+    ReportEntry    *head;
+    ReportEntry   **tail;
+    size_t          queued;     /* bytes queued */
+    bool            done;
+    int             error;      /* errno of the first failed write */
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;
+    pthread_t       thread;
+} report_writer;
+
+static bool
+report_write(int fd, const char *data, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0)
+    {
+        written = write(fd, data, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+static void
+report_dump_page(const ReportEntry *entry)
+{
+    int fd = open(entry->dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0 || !report_write(fd, entry->data, entry->len))
+        fprintf(stderr, "ERROR: %s: %s cannot be written\n", strerror(errno),
+            entry->dump_path);
+    if (fd >= 0)
+        close(fd);
+}
+
+static void *
+report_writer_main(void *arg)
+{
+    char buffer[REPORT_WRITE_BUFFER];
+    size_t buffered = 0;
+    ReportEntry *entry;
+
+    pthread_mutex_lock(&report_writer.lock);
+    for (;;)
+    {
+        entry = report_writer.head;
+        if (entry == NULL)
+        {
+            /* flush lines before sleeping so that the report keeps up */
+            if (buffered > 0)
+            {
+                pthread_mutex_unlock(&report_writer.lock);
+                if (!report_write(report_writer.fd, buffer, buffered))
+                    report_writer.error = errno;
+                buffered = 0;
+                pthread_mutex_lock(&report_writer.lock);
+                continue;
+            }
+            if (report_writer.done)
+                break;
+            pthread_cond_wait(&report_writer.wakeup, &report_writer.lock);
+            continue;
+        }
+        report_writer.head = entry->next;
+        if (report_writer.head == NULL)
+            report_writer.tail = &report_writer.head;
+        report_writer.queued -= entry->len;
+        pthread_cond_broadcast(&report_writer.wakeup);
+        pthread_mutex_unlock(&report_writer.lock);
+
+        if (entry->dump_path != NULL)
+            report_dump_page(entry);
+        else
+        {
+            if (buffered + entry->len > sizeof(buffer))
+            {
+                if (!report_write(report_writer.fd, buffer, buffered))
+                    report_writer.error = errno;
+                buffered = 0;
+            }
+            memcpy(buffer + buffered, entry->data, entry->len);
+            buffered += entry->len;
+        }
+        free(entry);
+
+        pthread_mutex_lock(&report_writer.lock);
+    }
+    pthread_mutex_unlock(&report_writer.lock);
+
+    return NULL;
+}
+
+static void
+report_queue(const char *data, size_t len, const char *dump_path)
+{
+    size_t pathlen = dump_path != NULL ? strlen(dump_path) + 1 : 0;
+    ReportEntry *entry = malloc(sizeof(ReportEntry) + len + pathlen);
+
+    if (entry == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory reporting a corrupt page\n");
+        exit(1);
+    }
+    entry->next = NULL;
+    entry->len = len;
+    memcpy(entry->data, data, len);
+    entry->dump_path = NULL;
+    if (dump_path != NULL)
+    {
+        entry->dump_path = entry->data + len;
+        memcpy(entry->dump_path, dump_path, pathlen);
+    }
+
+    pthread_mutex_lock(&report_writer.lock);
+    while (report_writer.queued > 0 &&
+           report_writer.queued + len > REPORT_QUEUE_BYTES)
+        pthread_cond_wait(&report_writer.wakeup, &report_writer.lock);
+    *report_writer.tail = entry;
+    report_writer.tail = &entry->next;
+    report_writer.queued += len;
+    pthread_cond_broadcast(&report_writer.wakeup);
+    pthread_mutex_unlock(&report_writer.lock);
+}
+
+static void
+start_report_writer(void)
+{
+    report_writer.fd = STDOUT_FILENO;
+    if (report_file != NULL && strcmp(report_file, "-") != 0)
+    {
+        report_writer.fd = open(report_file, O_WRONLY | O_CREAT | O_TRUNC,
+            0644);
+        if (report_writer.fd < 0)
+        {
+            fprintf(stderr, "ERROR: %s: report %s cannot be opened\n",
+                strerror(errno), report_file);
+            exit(1);
+        }
+    }
+    report_writer.tail = &report_writer.head;
+    pthread_mutex_init(&report_writer.lock, NULL);
+    pthread_cond_init(&report_writer.wakeup, NULL);
+    if (pthread_create(&report_writer.thread, NULL, report_writer_main,
+        NULL) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot start the report writer\n");
+        exit(1);
+    }
+}
+
+static void
+finish_report_writer(void)
+{
+    pthread_mutex_lock(&report_writer.lock);
+    report_writer.done = true;
+    pthread_cond_broadcast(&report_writer.wakeup);
+    pthread_mutex_unlock(&report_writer.lock);
+    pthread_join(report_writer.thread, NULL);
+
+    if (report_writer.error != 0)
+        fprintf(stderr, "ERROR: %s: report %s could not be written\n",
+            strerror(report_writer.error), report_file);
+    else if (report_writer.fd != STDOUT_FILENO && close(report_writer.fd) < 0)
+        fprintf(stderr, "ERROR: %s: report %s could not be written\n",
+            strerror(errno), report_file);
+}
+
+static char *
+json_escape(const char *value)
+{
+    /* the contents of a JSON string for value, freed by the caller */
+    char *result = malloc(6 * strlen(value) + 1);
+    char *out = result;
+
+    if (result == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory reporting %s\n", value);
+        exit(1);
+    }
+    for (; *value; value++)
+    {
+        if (*value == '"' || *value == '\\')
+        {
+            *out++ = '\\';
+            *out++ = *value;
+        }
+        else if ((unsigned char) *value < 0x20)
+            out += sprintf(out, "\\u%04x", (unsigned char) *value);
+        else
+            *out++ = *value;
+    }
+    *out = '\0';
+
+    return result;
+}
+
+static void
+report_page(const char *page, BlockNumber blkno, uint16 checksum,
+    const SegmentFile *file, const char *problem)
+{
+    /* blkno is relative to the segment file, the report and the name of a
+     * dumped page use the block number in the relation.  problem describes
+     * an invalid header, it is NULL for a checksum that does not match.
+     */
+    uint16 found = ((const PageHeaderData *) page)->pd_checksum;
+    BlockNumber absblkno = file->segmentBlockOffset + blkno;
+    const char *reldir = file->dirpath + manifest.prefix_len;
+    const char *fork;
+    size_t forklen;
+    char *relpath;
+    char *line;
+    char *dump_path;
+    char *c;
+
+    if (verbose && problem != NULL)
+        printf("ERROR: invalid page header in %s/%s[%u], %s\n",
+            file->dirpath, file->filename, blkno, problem);
+    else if (verbose)
+        printf("ERROR: corruption found in %s/%s[%u], expected %x, found %x\n",
+            file->dirpath, file->filename, blkno, checksum, found);
+
+    if (report_file != NULL)
+    {
+        /* relation file names are <relfilenode>[_<fork>][.<segment>] */
+        fork = strchr(file->filename, '_');
+        if (fork == NULL)
+        {
+            fork = "main";
+            forklen = 4;
+        }
+        else
+            forklen = strcspn(++fork, ".");
+
+        c = psprintf("%s%s%s", reldir, *reldir ? "/" : "", file->filename);
+        relpath = json_escape(c);
+        free(c);
+        line = psprintf("{\"path\":\"%s\",\"relfilenode\":%lu,"
+            "\"fork\":\"%.*s\",\"block\":%u,\"expected\":%u,"
+            "\"found\":%u%s%s%s}\n",
+            relpath, strtoul(file->filename, NULL, 10), (int) forklen, fork,
+            absblkno, checksum, found,
+            problem != NULL ? ",\"header\":\"" : "",
+            problem != NULL ? problem : "", problem != NULL ? "\"" : "");
+        report_queue(line, strlen(line), NULL);
+        free(line);
+        free(relpath);
+    }
+
+    if (dump_dir != NULL)
+    {
+        /* base/5/16384.1 block 131116 is dumped as base_5_16384.1_131116 */
+        dump_path = psprintf("%s/%s%s%s_%u", dump_dir, reldir,
+            *reldir ? "_" : "", file->filename, absblkno);
+        for (c = dump_path + strlen(dump_dir) + 1; *reldir; reldir++, c++)
+            if (*c == '/')
+                *c = '_';
+        report_queue(page, page_size, dump_path);
+        free(dump_path);
+    }
+}
+
+static const char *
+page_header_problem(const char *page)
+{
+    /* The checks of PageIsVerified() and of the header checks of amcheck
+     * that need nothing but the page, NULL if there is nothing wrong with
+     * it.  A page is new until PageInit() sets pd_upper, and then has to be
+     * all zero.
+     */
+    const PageHeaderData *phdr = (const PageHeaderData *) page;
+    const uint64 *word;
+
+    if (phdr->pd_upper == 0)
+    {
+        for (word = (const uint64 *) page;
+             word < (const uint64 *) (page + page_size); word++)
+            if (*word != 0)
+                return "new page is not all zero";
+        return NULL;
+    }
+    if (phdr->pd_checksum == 0 && !checksums_disabled)
+        return "checksum not set";
+    if ((phdr->pd_flags & ~PD_VALID_FLAG_BITS) != 0)
+        return "invalid pd_flags";
+    if ((phdr->pd_pagesize_version & 0xFF00) != page_size ||
+        (phdr->pd_pagesize_version & 0x00FF) != PG_PAGE_LAYOUT_VERSION)
+        return "invalid pd_pagesize_version";
+    if (phdr->pd_lower < SizeOfPageHeaderData ||
+        phdr->pd_lower > phdr->pd_upper ||
+        phdr->pd_upper > phdr->pd_special ||
+        phdr->pd_special > page_size ||
+        phdr->pd_special != MAXALIGN(phdr->pd_special))
+        return "invalid pd_lower, pd_upper or pd_special";
+
+    return NULL;
+}
+
+static uint64
+check_page_headers(const char *page, BlockNumber nblocks, BlockNumber blkno,
+    const uint16 *checksums, const SegmentFile *file, ScanIO *io)
+{
+    /* --check-headers on a batch of pages that were just checksummed, so
+     * their headers are in the CPU cache.  Returns the pages with a
+     * matching checksum, or none, whose header is wrong; those with a bad
+     * checksum are already counted as corrupt.
+     */
+    const PageHeaderData *phdr;
+    const char *problem;
+    BlockNumber j;
+    uint64 bad = 0;
+
+    for (j = 0; j < nblocks; j++, page += page_size)
+    {
+        phdr = (const PageHeaderData *) page;
+        if (is_page_corrupted(page, checksums[j]))
+            continue;
+
+        problem = page_header_problem(page);
+        if (problem != NULL)
+        {
+            report_page(page, blkno + j, checksums[j], file, problem);
+            bad++;
+        }
+        else if (phdr->pd_upper == 0)
+            STATS_ADD(io->stats.new_pages, 1);
+        else if (phdr->pd_lower <= SizeOfPageHeaderData)
+            STATS_ADD(io->stats.empty_pages, 1);
+    }
+    STATS_ADD(io->stats.bad_headers, bad);
+
+    return bad;
+}
+
+#ifndef NO_PAGE_TRACE
+static bool
+trace_page(const char *page, BlockNumber blkno, uint16 checksum,
+    const SegmentFile *file)
+{
+    /* Verbose per page variant of is_page_corrupted(), only used with -v.
+     * Builds with NO_PAGE_TRACE defined leave it out, -v then only traces
+     * files and corrupt pages.
+     */
+
+    PageHeader phdr = (PageHeader)page;
+
+    /* Segment size in bytes, page_size is 8192 by default, 8KB pages
+    *  1GB segment files are 131072 blocks of 8KB page size
+    *  NOTE: pd_pagesize_version is page size + version, since 8.3+, version is 4, 
+    *   resulting in pd_pagesize_version being 8196 when pagesize is 8KB
+    */
+    const uint64 segmentSize = (uint64) segment_blocks * page_size;
+
+    bool corrupted = is_page_corrupted(page, checksum);
+
+    printf("FILENAME: %s\n", file->filename);
+
+    printf("DEBUG: filename: %s/%s[%u]\n \
+        \tsegmentBlockOffset: %u, maxSegmentSize: %llu,\n \
+        \tsegmentNumber: %u, relative blkno: %u, absolute blkno: %u,\n \
+        \tchecksum: %x, phdr->pd_checksum: %x,\n \
+        \tphdr->pd_flags: %d, phdr->pd_lower: %d, phdr->pd_upper: %d,\n \
+        \tphdr->pd_special: %d, phdr->pd_pagesize_version: %d,\n \
+        \tphdr->pd_prune_xid: %d\n",
+        file->dirpath, file->filename, blkno,
+        file->segmentBlockOffset, (unsigned long long) segmentSize,
+        file->segmentNumber, blkno, file->segmentBlockOffset + blkno,
+        checksum, phdr->pd_checksum,
+        phdr->pd_flags, phdr->pd_lower, phdr->pd_upper,
+        phdr->pd_special, phdr->pd_pagesize_version,
+        phdr->pd_prune_xid );
+
+    if (corrupted)
+        report_page(page, blkno, checksum, file, NULL);
+
+    printf("DEBUG: is_page_corrupted for %s/%s[%u] returns: %d\n",
+            file->dirpath, file->filename, blkno, corrupted);
+
+    return corrupted;
+}
+#endif   /* NO_PAGE_TRACE */
+
+static uint64
+stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+record_time(uint64 *total_ns, uint64 *hist, uint64 start)
+{
+    uint64 ns = stats_clock() - start;
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS - 1 && ns > (UINT64_C(1000) << bucket))
+        bucket++;
+    STATS_ADD(*total_ns, ns);
+    STATS_ADD(hist[bucket], 1);
+}
+
+static void
+throttle_read(size_t len)
+{
+    /* called before every read of len bytes when throttling is enabled */
+    double rate = max_rate * 1024 * 1024;
+    double wait = 0;
+    uint64 now;
+    double elapsed;
+    struct timespec ts;
+
+    pthread_mutex_lock(&throttle.lock);
+    now = stats_clock();
+    elapsed = throttle.last_ns ? (now - throttle.last_ns) / 1e9 : 0;
+    throttle.last_ns = now;
+
+    if (rate > 0)
+    {
+        throttle.bytes += elapsed * rate;
+        if (throttle.bytes > rate * THROTTLE_BURST_SEC)
+            throttle.bytes = rate * THROTTLE_BURST_SEC;
+        throttle.bytes -= len;
+        if (throttle.bytes < 0)
+            wait = -throttle.bytes / rate;
+    }
+    if (max_iops > 0)
+    {
+        throttle.ops += elapsed * max_iops;
+        if (throttle.ops > max_iops * THROTTLE_BURST_SEC)
+            throttle.ops = max_iops * THROTTLE_BURST_SEC;
+        throttle.ops -= 1;
+        if (throttle.ops < 0 && -throttle.ops / max_iops > wait)
+            wait = -throttle.ops / max_iops;
+    }
+    pthread_mutex_unlock(&throttle.lock);
+
+    if (wait > 0)
+    {
+        ts.tv_sec = (time_t) wait;
+        ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+        /* a stopping daemon finishes its step without waiting */
+        while (!daemon_stop && nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+static void
+throttle_refund(size_t len)
+{
+    /* gives back the tokens of the part of a read past the end of file */
+    pthread_mutex_lock(&throttle.lock);
+    throttle.bytes += len;
+    pthread_mutex_unlock(&throttle.lock);
+}
+
+static char *
+alloc_read_buffer(size_t size)
+{
+    void *buffer;
+
+    if (posix_memalign(&buffer, READ_BUFFER_ALIGN, size) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot allocate read buffer of %zu bytes\n",
+            size);
+        exit(1);
+    }
+
+    return buffer;
+}
+
+static ssize_t
+read_fully(int fd, char *buffer, size_t len, off_t offset)
+{
+    /* pread() may return less than asked for well before the end of the
+     * file, keep reading until the buffer is full or EOF is reached so that
+     * the page boundaries in the buffer stay intact.
+     */
+    size_t done = 0;
+    ssize_t nread;
+
+    while (done < len)
+    {
+        nread = pread(fd, buffer + done, len - done, offset + done);
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            /* O_DIRECT rejects continuing at the unaligned offset a short
+             * read at the end of the file stopped at
+             */
+            if (errno == EINVAL && done > 0)
+                break;
+            return -1;
+        }
+        if (nread == 0)
+            break;
+        done += nread;
+    }
+
+    return done;
+}
+
+static void
+note_cache_residency(int fd, off_t offset, off_t len, ScanIO *io)
+{
+    /* Records in io->resident which OS pages of the range are in the page
+     * cache before the scan reads any of it, see mincore(2).  The snapshot is
+     * taken once per range since readahead would make pages look cached if
+     * each buffer was checked just before reading it.  If residency cannot
+     * be determined every page is treated as cached, so nothing is dropped.
+     */
+    off_t base = offset & ~((off_t) os_page_size - 1);
+    size_t maplen = len + (offset - base);
+    size_t npages = (maplen + os_page_size - 1) / os_page_size;
+    void *map = MAP_FAILED;
+
+    if (npages > io->resident_size)
+    {
+        free(io->resident);
+        io->resident = malloc(npages);
+        if (io->resident == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory allocating read state\n");
+            exit(1);
+        }
+        io->resident_size = npages;
+    }
+    io->resident_base = base;
+    io->drop_from = base;
+
+    if (maplen > 0)
+        map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, base);
+    if (map == MAP_FAILED || mincore(map, maplen, io->resident) < 0)
+        memset(io->resident, 1, npages);
+    if (map != MAP_FAILED)
+        munmap(map, maplen);
+    io->resident_pages = npages;
+}
+
+static void
+drop_cached_range(int fd, off_t end, bool final, ScanIO *io)
+{
+    /* Drops the part of the range up to end that has not been dropped yet.
+     * POSIX_FADV_DONTNEED evicts a page no matter who read it in, so only
+     * the runs of pages that were not cached before the scan started on the
+     * range are dropped, leaving the working set of the running server in
+     * place.  The page cache keeps large folios that are only evicted when
+     * the advice covers all of them, so except for the final call the range
+     * is cut at a DROP_CACHE_ALIGN boundary that no folio crosses.
+     */
+    size_t i = (io->drop_from - io->resident_base) / os_page_size;
+    size_t last;
+    size_t start;
+
+    if (!final)
+        end &= ~((off_t) DROP_CACHE_ALIGN - 1);
+    if (end <= io->drop_from)
+        return;
+
+    last = (end - io->resident_base + os_page_size - 1) / os_page_size;
+    if (last > io->resident_pages)
+        last = io->resident_pages;
+
+    while (i < last)
+    {
+        if (io->resident[i] & 1)
+        {
+            i++;
+            continue;
+        }
+        start = i;
+        while (i < last && !(io->resident[i] & 1))
+            i++;
+        posix_fadvise(fd, io->resident_base + (off_t) start * os_page_size,
+            (off_t) (i - start) * os_page_size, POSIX_FADV_DONTNEED);
+    }
+    io->drop_from = end;
+}
+
+static uint64
+page_digest(BlockNumber blkno, uint16 checksum)
+{
+    /* Mixes a page checksum with its block number, splitmix64 finalizer.
+     * The digest of a file is the sum of these over its pages, so ranges of
+     * a file scanned by different workers add up to the same digest.
+     */
+    uint64 x = ((uint64) blkno << 16) | checksum;
+
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+
+    return x;
+}
+
+static void
+count_corruption(uint64 corrupted)
+{
+    if (max_corrupt > 0 && corrupted > 0 &&
+        __sync_add_and_fetch(&corruption_seen, corrupted) >= max_corrupt)
+        __atomic_store_n(&scan_stop, 1, __ATOMIC_RELAXED);
+}
+
+static bool
+scan_stopped(void)
+{
+    return __atomic_load_n(&scan_stop, __ATOMIC_RELAXED);
+}
+
+static uint32 recheck_pages(const char *pages, BlockNumber nblocks,
+    BlockNumber blkno, const uint16 *checksums, const SegmentFile *file,
+    ScanIO *io);
+
+static uint64
+verify_buffer(const char *buffer, size_t nread, BlockNumber blkno,
+    const SegmentFile *file, ScanIO *io)
+{
+    /* blkno is relative to the segment file, checksums and digests use the
+     * absolute block number.
+     *
+     * Pages mapped with --mmap fault if the file is truncated, see
+     * read_range_mmap().  Each batch is only counted, traced and reported
+     * once all its pages were read, from a copy in io->buffer if they are
+     * read again, and io->verified moves past it, so that a fault never
+     * leaves a batch accounted for in part.
+     */
+    BlockNumber nblocks = nread / page_size;
+    BlockNumber absblkno = file->segmentBlockOffset + blkno;
+    uint16 checksums[CHECKSUM_BATCH];
+    const char *page;
+    BlockNumber batch;
+    BlockNumber i, j;
+    uint64 corrupted = 0;
+    uint64 batch_corrupted;
+    uint32 found;
+    uint64 digest;
+    uint64 start = 0;
+
+    for (i = 0; i < nblocks; i += batch)
+    {
+        batch = nblocks - i < CHECKSUM_BATCH ? nblocks - i : CHECKSUM_BATCH;
+        page = buffer + (size_t) i * page_size;
+        if (measure_times)
+            start = stats_clock();
+        checksum_pages(page, batch, absblkno + i, checksums);
+
+        found = 0;
+        digest = 0;
+        for (j = 0; j < batch; j++)
+        {
+            digest += page_digest(absblkno + i + j, checksums[j]);
+            found += is_page_corrupted(page + (size_t) j * page_size,
+                checksums[j]);
+        }
+        if (io->mapped && (found > 0 || check_headers || verbose))
+        {
+            memcpy(io->buffer, page, (size_t) batch * page_size);
+            page = io->buffer;
+        }
+        if (measure_times)
+            record_time(&io->stats.checksum_ns, io->stats.checksum_hist,
+                start);
+
+        batch_corrupted = 0;
+        if (check_headers)
+            batch_corrupted += check_page_headers(page, batch, blkno + i,
+                checksums, file, io);
+
+#ifndef NO_PAGE_TRACE
+        /* with --recheck a page is only reported after it is read again */
+        if (verbose && recheck_delay == 0)
+        {
+            found = 0;
+            for (j = 0; j < batch; j++)
+                found += trace_page(page + (size_t) j * page_size,
+                    blkno + i + j, checksums[j], file);
+        }
+        else
+#endif
+        if (found > 0 && recheck_delay > 0 &&
+            (file->fd >= 0 || file->url != NULL))
+            found = recheck_pages(page, batch, blkno + i, checksums, file,
+                io);
+        /* corrupt pages are rare, find them again to report them */
+        else if (found > 0 &&
+            (verbose || report_file != NULL || dump_dir != NULL))
+        {
+            for (j = 0; j < batch; j++)
+                if (is_page_corrupted(page + (size_t) j * page_size,
+                        checksums[j]))
+                    report_page(page + (size_t) j * page_size, blkno + i + j,
+                        checksums[j], file, NULL);
+        }
+        batch_corrupted += found;
+
+        STATS_ADD(io->stats.bytes_read, (uint64) batch * page_size);
+        STATS_ADD(io->stats.pages, batch);
+        STATS_ADD(io->stats.corrupt_pages, batch_corrupted);
+        io->digest += digest;
+        io->counted += batch_corrupted;
+        count_corruption(batch_corrupted);
+        io->verified = blkno + i + batch;
+        corrupted += batch_corrupted;
+    }
+
+    /* Anything left over at the end of the file that is not a whole page
+     * cannot be verified and is reported like a file that cannot be read.
+     */
+    if (nread % page_size != 0)
+    {
+        STATS_ADD(io->stats.bytes_read, nread % page_size);
+        fprintf(stderr, "ERROR: %s/%s: partial page of %zu bytes at block %u\n",
+            file->dirpath, file->filename, nread % page_size, blkno + nblocks);
+        io->counted++;
+        count_corruption(1);
+        corrupted++;
+    }
+
+    return corrupted;
+}
+
+static uint64
+read_range_sync(int fd, const SegmentFile *file,
+    BlockNumber startblk, BlockNumber endblk, ScanIO *io)
+{
+    BlockNumber blkno = startblk;
+    BlockNumber buffer_blocks = read_buffer_size / page_size;
+    BlockNumber nblocks;
+    uint64 corrupted = 0;
+    uint64 start = 0;
+    size_t request;
+    ssize_t nread;
+
+    while (blkno < endblk && !scan_stopped())
+    {
+        nblocks = endblk - blkno < buffer_blocks ? endblk - blkno : buffer_blocks;
+        request = (size_t) nblocks * page_size;
+
+        if (max_rate > 0 || max_iops > 0)
+            throttle_read(request);
+        if (measure_times)
+            start = stats_clock();
+        nread = read_fully(fd, io->buffer, request, (off_t) blkno * page_size);
+        if (measure_times)
+            record_time(&io->stats.read_ns, io->stats.read_hist, start);
+        if (max_rate > 0 && nread >= 0 && (size_t) nread < request)
+            throttle_refund(request - nread);
+        if (nread < 0)
+        {
+            fprintf(stderr, "ERROR: %s: %s/%s cannot be read at block %u\n",
+                strerror(errno), file->dirpath, file->filename, blkno);
+            corrupted++;
+            break;
+        }
+
+        corrupted += verify_buffer(io->buffer, nread, blkno, file, io);
+
+        if (io->drop_cache)
+            drop_cached_range(fd, (off_t) blkno * page_size + nread, false, io);
+        blkno += nread / page_size;
+
+        /* a short read means the end of the file was reached */
+        if ((size_t) nread < request)
+            break;
+    }
+
+    return corrupted;
+}
+
+static uint64
+sample_next(uint64 *state)
+{
+    /* splitmix64, the finalizer is the one of page_digest() */
+    uint64 x = (*state += UINT64_C(0x9e3779b97f4a7c15));
+
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+
+    return x;
+}
+
+static uint64
+read_sampled_pages(int fd, const SegmentFile *file, BlockNumber blkno,
+    BlockNumber nblocks, ScanIO *io)
+{
+    size_t request = (size_t) nblocks * page_size;
+    ssize_t nread;
+    uint64 start = 0;
+
+    if (max_rate > 0 || max_iops > 0)
+        throttle_read(request);
+    if (measure_times)
+        start = stats_clock();
+    nread = read_fully(fd, io->buffer, request, (off_t) blkno * page_size);
+    if (measure_times)
+        record_time(&io->stats.read_ns, io->stats.read_hist, start);
+    if (nread < 0)
+    {
+        fprintf(stderr, "ERROR: %s: %s/%s cannot be read at block %u\n",
+            strerror(errno), file->dirpath, file->filename, blkno);
+        return 1;
+    }
+
+    /* pages sampled beyond the end of a file that was truncated since it
+     * was measured are not reported, only whole pages are verified
+     */
+    return verify_buffer(io->buffer, nread - nread % page_size, blkno, file,
+        io);
+}
+
+static uint64
+read_range_sample(int fd, const SegmentFile *file,
+    BlockNumber startblk, BlockNumber endblk, ScanIO *io)
+{
+    /* Verifies a random subset of the pages of the range with positional
+     * reads.  The generator is seeded from --sample-seed and the file's path
+     * relative to the data directory, so the same seed picks the same pages
+     * whichever worker scans the file.  Pages are picked with selection
+     * sampling (Knuth's algorithm S), which visits them in file order, and
+     * adjacent picks are read together.
+     */
+    struct stat statbuf;
+    const char *relpath;
+    BlockNumber buffer_blocks = read_buffer_size / page_size;
+    BlockNumber nblocks, picks, picked, blkno;
+    BlockNumber runstart = 0, runlen = 0;
+    uint64 state = sample_seed;
+    uint64 corrupted = 0;
+
+    if (fstat(fd, &statbuf) < 0)
+    {
+        fprintf(stderr, "ERROR: %s: %s/%s cannot be read\n",
+            strerror(errno), file->dirpath, file->filename);
+        return 1;
+    }
+    if ((off_t) endblk * page_size > statbuf.st_size ||
+        endblk == InvalidBlockNumber)
+        endblk = statbuf.st_size / page_size;
+    if (endblk <= startblk)
+        endblk = startblk;
+    nblocks = endblk - startblk;
+
+    if (sample_pages > 0)
+        picks = nblocks < sample_pages ? nblocks : sample_pages;
+    else
+        picks = ceil(nblocks * sample_percent / 100);
+    __sync_fetch_and_add(&sample_population, nblocks);
+
+    /* FNV-1a over dirpath/filename, so that files of the same size do not
+     * all sample the same blocks
+     */
+    relpath = file->dirpath + manifest.prefix_len;
+    while (*relpath)
+        state = (state ^ (unsigned char) *relpath++) * UINT64_C(0x100000001b3);
+    state = (state ^ '/') * UINT64_C(0x100000001b3);
+    for (relpath = file->filename; *relpath; relpath++)
+        state = (state ^ (unsigned char) *relpath) * UINT64_C(0x100000001b3);
+    state ^= file->segmentNumber;
+
+    picked = 0;
+    for (blkno = startblk; blkno < endblk && picked < picks && !scan_stopped();
+         blkno++)
+    {
+        /* pick with probability (picks - picked) / (blocks left) */
+        if ((double) (endblk - blkno) * (sample_next(&state) >> 11) /
+            (UINT64_C(1) << 53) >= picks - picked)
+            continue;
+        picked++;
+
+        if (runlen > 0 && runstart + runlen == blkno && runlen < buffer_blocks)
+        {
+            runlen++;
+            continue;
+        }
+        if (runlen > 0)
+            corrupted += read_sampled_pages(fd, file, runstart, runlen, io);
+        runstart = blkno;
+        runlen = 1;
+    }
+    if (runlen > 0)
+        corrupted += read_sampled_pages(fd, file, runstart, runlen, io);
+
+    if (statbuf.st_size % page_size != 0 &&
+        endblk == statbuf.st_size / page_size)
+    {
+        fprintf(stderr, "ERROR: %s/%s: partial page of %zu bytes at block %u\n",
+            file->dirpath, file->filename,
+            (size_t) (statbuf.st_size % page_size), endblk);
+        corrupted++;
+    }
+
+    return corrupted;
+}
+
+static void
+mmap_fault_handler(int signo)
+{
+    if (mmap_fault_jmp != NULL)
+        siglongjmp(*mmap_fault_jmp, 1);
+
+    /* not raised by a mapped segment, die as if no handler was installed */
+    signal(SIGBUS, SIG_DFL);
+    raise(SIGBUS);
+}
+
+static uint64
+read_range_mmap(int fd, const SegmentFile *file,
+    BlockNumber startblk, BlockNumber endblk, ScanIO *io)
+{
+    /* Maps the whole pages of the range read-only and checksums them in
+     * place, the checksum kernels never write to a page.  Pages are passed
+     * to verify_buffer() read_buffer_size bytes at a time.  If the file is
+     * truncated while mapped, as a live server may do, the access raises
+     * SIGBUS; the pages from the batch that faulted on, none of which
+     * verify_buffer() has accounted for yet, are then verified again,
+     * along with anything the mapping did not cover such as a partial last
+     * page or pages appended since, by the blocking read path.
+     */
+    struct stat statbuf;
+    BlockNumber buffer_blocks = read_buffer_size / page_size;
+    BlockNumber lastblk;
+    BlockNumber nblocks;
+    volatile BlockNumber blkno = startblk;
+    uint64 corrupted;
+    uint64 counted = io->counted;
+    sigjmp_buf jmp;
+    off_t base;
+    size_t maplen;
+    char *map;
+
+    if (fstat(fd, &statbuf) < 0)
+    {
+        fprintf(stderr, "ERROR: %s: %s/%s cannot be stat'ed\n",
+            strerror(errno), file->dirpath, file->filename);
+        return 1;
+    }
+    lastblk = statbuf.st_size / page_size;
+    if (lastblk > endblk)
+        lastblk = endblk;
+    if (lastblk <= startblk)
+        return read_range_sync(fd, file, startblk, endblk, io);
+
+    base = ((off_t) startblk * page_size) & ~((off_t) os_page_size - 1);
+    maplen = (off_t) lastblk * page_size - base;
+    map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, base);
+    if (map == MAP_FAILED)
+        return read_range_sync(fd, file, startblk, endblk, io);
+
+    madvise(map, maplen, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, maplen, MADV_HUGEPAGE);
+#endif
+
+    /* only io, updated through a pointer, is looked at after a fault */
+    io->verified = startblk;
+    io->mapped = true;
+    if (sigsetjmp(jmp, 1) == 0)
+    {
+        mmap_fault_jmp = &jmp;
+        while (blkno < lastblk && !scan_stopped())
+        {
+            nblocks = lastblk - blkno < buffer_blocks ?
+                lastblk - blkno : buffer_blocks;
+            if (max_rate > 0 || max_iops > 0)
+                throttle_read((size_t) nblocks * page_size);
+            verify_buffer(map + ((off_t) blkno * page_size - base),
+                (size_t) nblocks * page_size, blkno, file, io);
+            blkno += nblocks;
+        }
+    }
+    else
+        fprintf(stderr, "WARNING: %s/%s was truncated while mapped, "
+            "reading it from block %u\n", file->dirpath, file->filename,
+            io->verified);
+    mmap_fault_jmp = NULL;
+    io->mapped = false;
+    munmap(map, maplen);
+
+    corrupted = io->counted - counted;
+    if (io->verified < endblk && !scan_stopped())
+        corrupted += read_range_sync(fd, file, io->verified, endblk, io);
+
+    return corrupted;
+}
+
+#ifdef USE_IO_URING
+
+static int
+uring_setup(UringReader *ring, unsigned depth)
+{
+    /* Sets up a ring with the raw system calls and maps the submission and
+     * completion queues, see io_uring_setup(2).  Returns -1 with errno set
+     * if the kernel does not support io_uring or it is not permitted.
+     */
+    struct io_uring_params params;
+    size_t sq_len;
+    size_t cq_len;
+    char *sq_ptr;
+    char *cq_ptr;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_len = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_len > sq_len)
+            sq_len = cq_len;
+        cq_len = sq_len;
+    }
+
+    sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else
+    {
+        cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    ring->sq_ptr = sq_ptr;
+    ring->sq_len = sq_len;
+    ring->cq_ptr = cq_ptr;
+    ring->cq_len = cq_len;
+    ring->sq_tail = (unsigned *) (sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+    ring->to_submit = 0;
+
+    return 0;
+
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+static void
+uring_release(UringReader *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+static void
+uring_queue_read(UringReader *ring, int fd, struct iovec *iov, off_t offset,
+    unsigned slot)
+{
+    /* only this thread produces submissions, so the tail is read plainly and
+     * published with a release store once the entry is filled in
+     */
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    if (max_rate > 0 || max_iops > 0)
+        throttle_read(iov->iov_len);
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64) (uintptr_t) iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+static int
+uring_wait(UringReader *ring, unsigned *slot, int *res)
+{
+    /* submits everything queued so far and waits for one completion */
+    unsigned head;
+
+    for (;;)
+    {
+        head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            break;
+
+        if (syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ring->to_submit = 0;
+    }
+
+    *slot = ring->cqes[head & *ring->cq_mask].user_data;
+    *res = ring->cqes[head & *ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static uint64
+read_range_uring(int fd, const SegmentFile *file,
+    BlockNumber startblk, BlockNumber endblk, ScanIO *io)
+{
+    /* Keeps up to io_depth reads of read_buffer_size in flight for the range
+     * and verifies each buffer as it completes, completions may arrive in
+     * any order since every slot remembers the block it was read from.
+     * The range ends at the file size when the scan starts, pages appended
+     * later are not read.
+     */
+    UringReader *ring = io->uring;
+    BlockNumber buffer_blocks = read_buffer_size / page_size;
+    BlockNumber next = startblk;
+    BlockNumber lastblk;
+    BlockNumber nblocks;
+    struct iovec iov[MAX_IO_DEPTH];
+    BlockNumber slot_blkno[MAX_IO_DEPTH];
+    struct stat statbuf;
+    uint64 corrupted = 0;
+    unsigned inflight = 0;
+    unsigned slot;
+    uint64 start = 0;
+    ssize_t nread;
+    int waited;
+    int res;
+
+    if (fstat(fd, &statbuf) < 0)
+    {
+        fprintf(stderr, "ERROR: %s: %s/%s cannot be stat'ed\n",
+            strerror(errno), file->dirpath, file->filename);
+        return 1;
+    }
+    lastblk = (statbuf.st_size + page_size - 1) / page_size;
+    if (lastblk > endblk)
+        lastblk = endblk;
+
+    for (slot = 0; slot < io_depth; slot++)
+        slot_blkno[slot] = InvalidBlockNumber;
+
+    for (slot = 0; slot < io_depth && next < lastblk; slot++)
+    {
+        nblocks = lastblk - next < buffer_blocks ? lastblk - next : buffer_blocks;
+        iov[slot].iov_base = io->buffer + (size_t) slot * read_buffer_size;
+        iov[slot].iov_len = (size_t) nblocks * page_size;
+        slot_blkno[slot] = next;
+        uring_queue_read(ring, fd, &iov[slot], (off_t) next * page_size, slot);
+        next += nblocks;
+        inflight++;
+    }
+
+    while (inflight > 0)
+    {
+        if (measure_times)
+            start = stats_clock();
+        waited = uring_wait(ring, &slot, &res);
+        if (measure_times)
+            record_time(&io->stats.read_ns, io->stats.read_hist, start);
+        if (waited < 0)
+        {
+            /* the ring is unusable, outstanding reads cannot be waited for
+             * either, so give up on the whole scan
+             */
+            fprintf(stderr, "ERROR: %s: io_uring_enter failed on %s/%s\n",
+                strerror(errno), file->dirpath, file->filename);
+            exit(1);
+        }
+        inflight--;
+
+        if (res < 0)
+        {
+            fprintf(stderr, "ERROR: %s: %s/%s cannot be read at block %u\n",
+                strerror(-res), file->dirpath, file->filename, slot_blkno[slot]);
+            corrupted++;
+            next = lastblk;
+            continue;
+        }
+
+        /* finish a short read synchronously, it only stays short at EOF */
+        nread = res;
+        if ((size_t) nread < iov[slot].iov_len)
+        {
+            ssize_t rest = read_fully(fd, (char *) iov[slot].iov_base + nread,
+                iov[slot].iov_len - nread,
+                (off_t) slot_blkno[slot] * page_size + nread);
+
+            if (rest > 0)
+                nread += rest;
+        }
+
+        corrupted += verify_buffer(iov[slot].iov_base, nread,
+            slot_blkno[slot], file, io);
+
+
+        /* a stopped scan waits for the reads in flight and queues no more */
+        if ((size_t) nread < iov[slot].iov_len || scan_stopped())
+            next = lastblk;
+
+        if (next < lastblk)
+        {
+            nblocks = lastblk - next < buffer_blocks ? lastblk - next : buffer_blocks;
+            iov[slot].iov_len = (size_t) nblocks * page_size;
+            slot_blkno[slot] = next;
+            uring_queue_read(ring, fd, &iov[slot], (off_t) next * page_size,
+                slot);
+            next += nblocks;
+            inflight++;
+        }
+        else
+            slot_blkno[slot] = InvalidBlockNumber;
+
+        /* completions arrive out of order, pages can be dropped up to the
+         * oldest read still in flight
+         */
+        if (io->drop_cache)
+        {
+            BlockNumber oldest = next;
+            unsigned i;
+
+            for (i = 0; i < io_depth; i++)
+                if (slot_blkno[i] < oldest)
+                    oldest = slot_blkno[i];
+            drop_cached_range(fd, (off_t) oldest * page_size, false, io);
+        }
+    }
+
+    return corrupted;
+}
+
+#endif   /* USE_IO_URING */
+
+/* Segment files in object storage are read with HTTP range requests, so
+ * that a backup is verified in place as its bytes arrive instead of being
+ * downloaded first.  Requests go over plain HTTP/1.1 sockets, no HTTP or
+ * TLS library is needed; https endpoints are reached through a local TLS
+ * proxy, with --http-header "Host: ..." naming the bucket.  Each range of
+ * a file is one request, with --jobs the ranges of a file are requested by
+ * several workers at a time.  Presigned URLs carry their credentials in
+ * the query string, which is left out of everything reported.
+ */
+#define HTTP_HEADER_MAX 16384
+#define HTTP_RETRIES 3
+#define HTTP_TIMEOUT_SEC 60
+
+static bool
+parse_http_url(const char *url, char **host, char **port, const char **target)
+{
+    /* splits http://host[:port]/target, the host and port are freed by
+     * the caller
+     */
+    const char *authority = url + 7;
+    const char *colon;
+    size_t len;
+
+    if (strncmp(url, "http://", 7) != 0)
+        return false;
+    len = strcspn(authority, "/?");
+    *target = authority[len] == '/' ? authority + len : "/";
+    colon = memchr(authority, ':', len);
+    if (colon == NULL)
+    {
+        *host = psprintf("%.*s", (int) len, authority);
+        *port = psprintf("80");
+    }
+    else
+    {
+        *host = psprintf("%.*s", (int) (colon - authority), authority);
+        *port = psprintf("%.*s", (int) (authority + len - colon - 1),
+            colon + 1);
+    }
+
+    return true;
+}
+
+static int
+http_connect(const char *host, const char *port, const char **error)
+{
+    struct addrinfo hints;
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    struct timeval timeout;
+    int fd = -1;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rc = getaddrinfo(host, port, &hints, &addrs);
+    if (rc != 0)
+    {
+        *error = gai_strerror(rc);
+        return -1;
+    }
+    for (addr = addrs; addr != NULL; addr = addr->ai_next)
+    {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+        *error = strerror(errno);
+    freeaddrinfo(addrs);
+
+    /* a stalled connection fails the read instead of hanging the scan */
+    if (fd >= 0)
+    {
+        timeout.tv_sec = HTTP_TIMEOUT_SEC;
+        timeout.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    return fd;
+}
+
+static const char *
+http_header_value(const char *headers, const char *name)
+{
+    /* the value of the header name, NULL if the response has none */
+    size_t len = strlen(name);
+    const char *line;
+
+    for (line = strstr(headers, "\r\n"); line != NULL;
+         line = strstr(line, "\r\n"))
+    {
+        line += 2;
+        if (strncasecmp(line, name, len) == 0 && line[len] == ':')
+            return line + len + 1 + strspn(line + len + 1, " \t");
+    }
+
+    return NULL;
+}
+
+static int
+http_request(const char *url, off_t start, off_t end, off_t *total,
+    off_t *length, const char **error)
+{
+    /* Sends a GET of bytes [start, end) of url, end -1 for the rest of the
+     * object, and reads the response headers.  Returns the socket to read
+     * the length bytes of the body from, with the size of the object in
+     * total if the response tells, or -1 with the reason in error, -2 if
+     * asking again cannot help.  A range past the end of the object has no
+     * body.
+     */
+    static __thread char headers[HTTP_HEADER_MAX];
+    static __thread char status_error[64];
+    char *host;
+    char *port;
+    const char *target;
+    const char *value;
+    char *request;
+    size_t len = 0;
+    ssize_t n;
+    int status;
+    long long first, last, size;
+    int fd;
+
+    *total = -1;
+    *length = -1;
+    if (!parse_http_url(url, &host, &port, &target))
+    {
+        *error = "not an http:// URL";
+        return -1;
+    }
+    fd = http_connect(host, port, error);
+    if (fd < 0)
+    {
+        free(host);
+        free(port);
+        return -1;
+    }
+
+    if (end < 0)
+        request = psprintf("GET %s HTTP/1.1\r\n%s%s%sRange: bytes=%lld-\r\n"
+            "Connection: close\r\n%s\r\n", target,
+            http_host_set ? "" : "Host: ", http_host_set ? "" : host,
+            http_host_set ? "" : "\r\n", (long long) start,
+            http_headers ? http_headers : "");
+    else
+        request = psprintf("GET %s HTTP/1.1\r\n%s%s%sRange: bytes=%lld-%lld"
+            "\r\nConnection: close\r\n%s\r\n", target,
+            http_host_set ? "" : "Host: ", http_host_set ? "" : host,
+            http_host_set ? "" : "\r\n", (long long) start,
+            (long long) end - 1, http_headers ? http_headers : "");
+    free(host);
+    free(port);
+    while (len < strlen(request))
+    {
+        n = send(fd, request + len, strlen(request) - len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            *error = strerror(errno);
+            free(request);
+            close(fd);
+            return -1;
+        }
+        len += n;
+    }
+    free(request);
+
+    /* the headers are read a byte at a time so that none of the body is
+     * consumed with them
+     */
+    len = 0;
+    while (len < 4 || memcmp(headers + len - 4, "\r\n\r\n", 4) != 0)
+    {
+        if (len == sizeof(headers) - 1)
+        {
+            *error = "response headers too long";
+            close(fd);
+            return -1;
+        }
+        n = recv(fd, headers + len, 1, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            *error = n < 0 ? strerror(errno) : "connection closed";
+            close(fd);
+            return -1;
+        }
+        len++;
+    }
+    headers[len] = '\0';
+
+    if (sscanf(headers, "HTTP/%*d.%*d %d", &status) != 1)
+    {
+        *error = "malformed response";
+        close(fd);
+        return -1;
+    }
+    value = http_header_value(headers, "Transfer-Encoding");
+    if (value != NULL && strncasecmp(value, "identity", 8) != 0)
+    {
+        *error = "chunked responses are not supported";
+        close(fd);
+        return -1;
+    }
+
+    if (status == 206)
+    {
+        value = http_header_value(headers, "Content-Range");
+        n = value == NULL ? 0 :
+            sscanf(value, "bytes %lld-%lld/%lld", &first, &last, &size);
+        if (n < 2 || first != start)
+        {
+            *error = "unexpected Content-Range";
+            close(fd);
+            return -1;
+        }
+        if (n == 3)
+            *total = size;
+        *length = last - first + 1;
+    }
+    else if (status == 200 && start == 0)
+    {
+        /* a server ignoring Range sends the whole object */
+        value = http_header_value(headers, "Content-Length");
+        if (value != NULL)
+            *total = *length = strtoll(value, NULL, 10);
+        if (end >= 0 && (*length < 0 || *length > end))
+            *length = end;
+    }
+    else if (status == 416)
+    {
+        value = http_header_value(headers, "Content-Range");
+        if (value != NULL && sscanf(value, "bytes */%lld", &size) == 1)
+            *total = size;
+        *length = 0;
+    }
+    else
+    {
+        snprintf(status_error, sizeof(status_error), "HTTP status %d%s",
+            status, status == 200 ? ", range requests not supported" : "");
+        *error = status_error;
+        close(fd);
+        /* only timeouts, throttling and server errors are worth retrying */
+        return status >= 500 || status == 408 || status == 429 ? -1 : -2;
+    }
+
+    return fd;
+}
+
+static ssize_t
+recv_fully(int fd, char *buffer, size_t len)
+{
+    /* like read_fully(), for the body of a response */
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = recv(fd, buffer + done, len - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+static off_t
+http_object_size(const char *url, const char **error)
+{
+    /* the size of an object, asked with a range of one byte so that
+     * presigned GET URLs work too, -1 with the reason in error
+     */
+    off_t total;
+    off_t length;
+    int fd = http_request(url, 0, 1, &total, &length, error);
+
+    if (fd < 0)
+        return -1;
+    close(fd);
+    if (total < 0)
+        *error = "size not known";
+
+    return total;
+}
+
+static uint64
+read_range_http(const SegmentFile *file, BlockNumber startblk,
+    BlockNumber endblk, ScanIO *io)
+{
+    /* Requests the range and verifies the body read_buffer_size bytes at
+     * a time as it arrives.  A request failing part way is sent again from
+     * the first page not verified yet, up to HTTP_RETRIES times in a row
+     * and a second longer apart each time.  So is the rest of a range the
+     * server sent a part of only.
+     */
+    BlockNumber blkno = startblk;
+    BlockNumber buffer_blocks = read_buffer_size / page_size;
+    off_t end = endblk == InvalidBlockNumber ? -1 : (off_t) endblk * page_size;
+    off_t remaining = 0;
+    off_t total;
+    const char *error = NULL;
+    uint64 corrupted = 0;
+    uint64 start = 0;
+    size_t request;
+    ssize_t nread;
+    int retries = 0;
+    int fd = -1;
+    bool received = false;
+    bool more;
+
+    while (blkno < endblk && !scan_stopped())
+    {
+        if (fd < 0)
+        {
+            if (measure_times)
+                start = stats_clock();
+            fd = http_request(file->url, (off_t) blkno * page_size, end,
+                &total, &remaining, &error);
+            if (measure_times)
+                record_time(&io->stats.read_ns, io->stats.read_hist, start);
+            if (fd == -2)
+                retries = HTTP_RETRIES;
+            if (fd < 0)
+            {
+                fd = -1;
+                if (++retries > HTTP_RETRIES)
+                    break;
+                sleep(retries);
+                continue;
+            }
+            received = false;
+        }
+
+        /* a response ends at the end of the object, or where the pages
+         * still missing are asked for again; a part of a page is only
+         * left at the end of the object
+         */
+        more = total >= 0 ?
+            (off_t) blkno * page_size + remaining < total : end >= 0;
+        request = (size_t) buffer_blocks * page_size;
+        if (remaining >= 0 && (off_t) request > remaining)
+        {
+            request = remaining;
+            if (more)
+                request -= request % page_size;
+        }
+        if (request == 0)
+        {
+            if (!more)
+                break;
+            close(fd);
+            fd = -1;
+            if (!received)
+            {
+                error = "empty range received";
+                if (++retries > HTTP_RETRIES)
+                    break;
+                sleep(retries);
+            }
+            continue;
+        }
+
+        if (max_rate > 0 || max_iops > 0)
+            throttle_read(request);
+        if (measure_times)
+            start = stats_clock();
+        nread = recv_fully(fd, io->buffer, request);
+        if (measure_times)
+            record_time(&io->stats.read_ns, io->stats.read_hist, start);
+        if (nread < 0 || (remaining >= 0 && (size_t) nread < request))
+        {
+            /* the pages received so far are read again with the rest */
+            error = nread < 0 ? strerror(errno) : "connection closed";
+            close(fd);
+            fd = -1;
+            if (++retries > HTTP_RETRIES)
+                break;
+            sleep(retries);
+            continue;
+        }
+
+        corrupted += verify_buffer(io->buffer, nread, blkno, file, io);
+        blkno += nread / page_size;
+        if (remaining >= 0)
+            remaining -= nread;
+        received = true;
+        retries = 0;
+
+        /* without a length, the end of the body is the end of the object,
+         * and so is a part of a page
+         */
+        if ((size_t) nread < request || nread % page_size != 0)
+            break;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (error != NULL && retries > HTTP_RETRIES)
+    {
+        fprintf(stderr, "ERROR: %s: %s/%s cannot be read at block %u\n",
+            error, file->dirpath, file->filename, blkno);
+        corrupted++;
+    }
+
+    return corrupted;
+}
+
+static void
+add_http_header(const char *header)
+{
+    char *headers;
+
+    if (strncasecmp(header, "Host:", 5) == 0)
+        http_host_set = true;
+    headers = psprintf("%s%s\r\n", http_headers ? http_headers : "", header);
+    free(http_headers);
+    http_headers = headers;
+}
+
+static const char *
+reread_page(const SegmentFile *file, BlockNumber blkno, char *span)
+{
+    /* Reads block blkno of the file again into span, RECHECK_SPAN bytes
+     * aligned like the reads of a file opened with O_DIRECT must be.
+     * Returns where the page is in span, or NULL if it cannot be read.
+     */
+    off_t offset = (off_t) blkno * page_size;
+    off_t start = offset & ~((off_t) READ_BUFFER_ALIGN - 1);
+    const char *error = NULL;
+    off_t total;
+    off_t length;
+    ssize_t nread;
+    int fd;
+
+    if (max_rate > 0 || max_iops > 0)
+        throttle_read(page_size);
+
+    if (file->url != NULL)
+    {
+        fd = http_request(file->url, offset, offset + page_size, &total,
+            &length, &error);
+        if (fd < 0)
+            return NULL;
+        nread = length == page_size ? recv_fully(fd, span, page_size) : -1;
+        close(fd);
+        return nread == page_size ? span : NULL;
+    }
+
+    nread = read_fully(file->fd, span, RECHECK_SPAN, start);
+    if (nread < offset - start + page_size)
+        return NULL;
+
+    return span + (offset - start);
+}
+
+static uint32
+recheck_pages(const char *pages, BlockNumber nblocks, BlockNumber blkno,
+    const uint16 *checksums, const SegmentFile *file, ScanIO *io)
+{
+    /* Pages of a running server are written while they are read, and a
+     * read can return a page half written, with a checksum that does not
+     * match.  After recheck_delay milliseconds every page of the batch
+     * that failed is read again, until it verifies or two reads in a row
+     * return the same image, RECHECK_READS times at most.  Only the pages
+     * that never verify are counted and reported, with their last image.
+     */
+    BlockNumber absblkno = file->segmentBlockOffset + blkno;
+    const char *previous;
+    const char *page;
+    struct timespec delay;
+    uint16 checksum;
+    uint32 corrupted = 0;
+    BlockNumber j;
+    bool verified;
+    bool same;
+    int reads;
+
+    delay.tv_sec = recheck_delay / 1000;
+    delay.tv_nsec = (recheck_delay % 1000) * 1000000L;
+    nanosleep(&delay, NULL);
+
+    for (j = 0; j < nblocks; j++)
+    {
+        previous = pages + (size_t) j * page_size;
+        checksum = checksums[j];
+        if (!is_page_corrupted(previous, checksum))
+            continue;
+
+        verified = false;
+        for (reads = 0; reads < RECHECK_READS && !verified; reads++)
+        {
+            if (reads > 0)
+                nanosleep(&delay, NULL);
+            /* alternate between the two images so previous stays intact */
+            page = reread_page(file, blkno + j,
+                io->recheck + (reads % 2) * RECHECK_SPAN);
+            if (page == NULL)
+                break;
+
+            checksum_pages(page, 1, absblkno + j, &checksum);
+            verified = !is_page_corrupted(page, checksum);
+            same = memcmp(page, previous, page_size) == 0;
+            previous = page;
+            if (same)
+                break;
+        }
+
+        if (verified)
+        {
+            /* the digest of the file is that of the page as written, the
+             * sum of the page digests wraps around the same either way
+             */
+            io->digest += page_digest(absblkno + j, checksum) -
+                page_digest(absblkno + j, checksums[j]);
+            STATS_ADD(io->stats.torn_pages, 1);
+            if (verbose)
+                printf("DEBUG: %s/%s: block %u was being written, verified "
+                    "when read again\n", file->dirpath, file->filename,
+                    blkno + j);
+            continue;
+        }
+
+        corrupted++;
+        if (verbose || report_file != NULL || dump_dir != NULL)
+            report_page(previous, blkno + j, checksum, file, NULL);
+    }
+
+    return corrupted;
+}
+
+/* State of --metrics.  metrics_lock guards the list of ScanIO in use, the
+ * totals they are folded into when released, and the progress of the daemon
+ * pass.
+ */
+#define METRICS_INTERVAL_SEC 10
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metrics_wakeup = PTHREAD_COND_INITIALIZER;
+
+static struct
+{
+    ScanIO         *ios;
+    ScanStats      *workers;        /* of the released ScanIO, per worker */
+    int             nworkers;
+    bool            done;
+    bool            warned;
+    pthread_t       thread;
+    time_t          started;
+    uint64          pass_number;    /* of the daemon, 0 for one shot runs */
+    time_t          pass_start;
+    time_t          pass_end;       /* of the last finished pass */
+    uint64          pass_bytes;
+    uint64          pass_remaining;
+} metrics;
+
+static void
+add_scan_stats(ScanStats *totals, const ScanStats *stats)
+{
+    /* stats may be those of a thread that is still scanning */
+    int i;
+
+    totals->bytes_read += __atomic_load_n(&stats->bytes_read, __ATOMIC_RELAXED);
+    totals->pages += __atomic_load_n(&stats->pages, __ATOMIC_RELAXED);
+    totals->files += __atomic_load_n(&stats->files, __ATOMIC_RELAXED);
+    totals->corrupt_pages += __atomic_load_n(&stats->corrupt_pages,
+        __ATOMIC_RELAXED);
+    totals->new_pages += __atomic_load_n(&stats->new_pages, __ATOMIC_RELAXED);
+    totals->empty_pages += __atomic_load_n(&stats->empty_pages,
+        __ATOMIC_RELAXED);
+    totals->bad_headers += __atomic_load_n(&stats->bad_headers,
+        __ATOMIC_RELAXED);
+    totals->torn_pages += __atomic_load_n(&stats->torn_pages,
+        __ATOMIC_RELAXED);
+    totals->read_ns += __atomic_load_n(&stats->read_ns, __ATOMIC_RELAXED);
+    totals->checksum_ns += __atomic_load_n(&stats->checksum_ns,
+        __ATOMIC_RELAXED);
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        totals->read_hist[i] += __atomic_load_n(&stats->read_hist[i],
+            __ATOMIC_RELAXED);
+        totals->checksum_hist[i] += __atomic_load_n(&stats->checksum_hist[i],
+            __ATOMIC_RELAXED);
+    }
+}
+
+static void
+init_scan_io(ScanIO *io)
+{
+    size_t nbuffers = 1;
+
+#ifdef USE_IO_URING
+    io->uring = NULL;
+    if (use_io_uring)
+    {
+        io->uring = malloc(sizeof(UringReader));
+        if (io->uring == NULL || uring_setup(io->uring, io_depth) < 0)
+        {
+            /* kernels before 5.1, or ones with io_uring disabled, keep
+             * working with blocking reads
+             */
+            fprintf(stderr, "WARNING: %s: io_uring not available, "
+                "falling back to blocking reads\n", strerror(errno));
+            free(io->uring);
+            io->uring = NULL;
+        }
+    }
+    if (io->uring != NULL)
+        nbuffers = io_depth;
+#endif
+    io->buffer = alloc_read_buffer(read_buffer_size * nbuffers);
+    io->recheck = NULL;
+    if (recheck_delay > 0)
+        io->recheck = alloc_read_buffer(2 * RECHECK_SPAN);
+    io->mapped = false;
+    io->drop_cache = false;
+    io->resident = NULL;
+    io->resident_size = 0;
+    memset(&io->stats, 0, sizeof(io->stats));
+
+    pthread_mutex_lock(&metrics_lock);
+    io->next_io = metrics.ios;
+    metrics.ios = io;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void
+release_scan_io(ScanIO *io)
+{
+    ScanIO **prev;
+
+    pthread_mutex_lock(&metrics_lock);
+    add_scan_stats(&scan_stats.totals, &io->stats);
+    if (metrics_file != NULL)
+    {
+        if (io->worker >= metrics.nworkers)
+        {
+            metrics.workers = realloc(metrics.workers,
+                (io->worker + 1) * sizeof(ScanStats));
+            if (metrics.workers == NULL)
+            {
+                fprintf(stderr, "ERROR: out of memory\n");
+                exit(1);
+            }
+            memset(metrics.workers + metrics.nworkers, 0,
+                (io->worker + 1 - metrics.nworkers) * sizeof(ScanStats));
+            metrics.nworkers = io->worker + 1;
+        }
+        add_scan_stats(&metrics.workers[io->worker], &io->stats);
+    }
+    for (prev = &metrics.ios; *prev != io; prev = &(*prev)->next_io)
+        ;
+    *prev = io->next_io;
+    pthread_mutex_unlock(&metrics_lock);
+
+#ifdef USE_IO_URING
+    if (io->uring != NULL)
+    {
+        uring_release(io->uring);
+        free(io->uring);
+    }
+#endif
+    free(io->buffer);
+    free(io->recheck);
+    free(io->resident);
+}
+
+static DatabaseStats *
+new_database_stats(const char *dirpath)
+{
+    /* called once per directory by the walk, see walk_lock */
+    const char *path = dirpath + manifest.prefix_len;
+    DatabaseStats *db = calloc(1, sizeof(DatabaseStats) + strlen(path));
+
+    if (db == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory recording stats of %s\n",
+            dirpath);
+        exit(1);
+    }
+    strcpy(db->path, path);
+    pthread_mutex_lock(&walk_lock);
+    if (scan_stats.last == NULL)
+        scan_stats.last = &scan_stats.databases;
+    *scan_stats.last = db;
+    scan_stats.last = &db->next;
+    pthread_mutex_unlock(&walk_lock);
+
+    return db;
+}
+
+static void
+add_database_stats(DatabaseStats *db, const ScanStats *before,
+    const ScanStats *after)
+{
+    __sync_fetch_and_add(&db->totals.bytes_read,
+        after->bytes_read - before->bytes_read);
+    __sync_fetch_and_add(&db->totals.pages, after->pages - before->pages);
+    __sync_fetch_and_add(&db->totals.files, after->files - before->files);
+    __sync_fetch_and_add(&db->totals.read_ns, after->read_ns - before->read_ns);
+    __sync_fetch_and_add(&db->totals.checksum_ns,
+        after->checksum_ns - before->checksum_ns);
+}
+
+static void
+print_throughput(const char *label, const ScanStats *stats, uint64 ns)
+{
+    double seconds = ns / 1e9;
+
+    printf("STATS: %s: %llu files, %llu pages, %.1f MB",
+        label,
+        (unsigned long long) stats->files,
+        (unsigned long long) stats->pages,
+        stats->bytes_read / (1024.0 * 1024.0));
+    if (seconds > 0)
+        printf(", %.1f MB/s, %.0f pages/s",
+            stats->bytes_read / (1024.0 * 1024.0) / seconds,
+            stats->pages / seconds);
+    printf("\n");
+}
+
+static void
+print_stats(uint64 wall_ns)
+{
+    /* Thread times are summed over all workers, so with -j N they can add
+     * up to N times the wall time.  Per database rates are relative to the
+     * thread time spent on the database.
+     */
+    DatabaseStats *db;
+
+    printf("STATS: walk: %llu directories, %llu files, %.3f s\n",
+        (unsigned long long) scan_stats.dirs,
+        (unsigned long long) scan_stats.files,
+        scan_stats.walk_ns / 1e9);
+    printf("STATS: thread time: read %.3f s, checksum %.3f s, "
+        "wall time %.3f s, %d workers\n",
+        scan_stats.totals.read_ns / 1e9,
+        scan_stats.totals.checksum_ns / 1e9,
+        wall_ns / 1e9, num_workers);
+    print_throughput("total", &scan_stats.totals, wall_ns);
+
+    for (db = scan_stats.databases; db != NULL; db = db->next)
+        print_throughput(db->path, &db->totals,
+            db->totals.read_ns + db->totals.checksum_ns);
+}
+
+static void
+print_sample_report(uint64 corrupted)
+{
+    /* A scan that finds nothing in n of N pages bounds the fraction of
+     * corrupt pages: with p corrupt, all n samples miss with probability
+     * (1 - p)^n, which is 5% at p = 1 - 0.05^(1/n).  The chance to hit at
+     * least one of k corrupt pages is close to 1 - (1 - n/N)^k.
+     */
+    uint64 sampled = scan_stats.totals.pages;
+    double fraction;
+
+    if (sample_population == 0)
+        fraction = 1;
+    else
+        fraction = (double) sampled / sample_population;
+
+    printf("SAMPLE: verified %llu of %llu pages (%.2f%%), seed %llu\n",
+        (unsigned long long) sampled, (unsigned long long) sample_population,
+        100 * fraction, (unsigned long long) sample_seed);
+
+    if (sampled == 0)
+        return;
+
+    if (corrupted > 0)
+    {
+        printf("SAMPLE: an estimated %.0f pages are corrupt, run a full "
+            "verification\n", corrupted / fraction);
+        return;
+    }
+
+    printf("SAMPLE: with 95%% confidence less than %.4f%% of the pages "
+        "are corrupt\n", 100 * (1 - pow(0.05, 1.0 / sampled)));
+    printf("SAMPLE: 1 corrupt page would have been found with probability "
+        "%.2f%%, 10 with %.2f%%, 100 with %.2f%%\n",
+        100 * fraction,
+        100 * (1 - pow(1 - fraction, 10)),
+        100 * (1 - pow(1 - fraction, 100)));
+}
+
+static uint64
+scan_segment_range(const char *filename, const char *dirpath,
+    const char *url, BlockNumber startblk, BlockNumber endblk,
+    FileRecord *record, DatabaseStats *db, ScanIO *io)
+{
+
+    /* Performance considerations:
+     * segment files can be up to 1GB in size before they are split
+     * https://www.postgresql.org/docs/9.6/static/storage-file-layout.html
+     *
+     * Pages are read read_buffer_size bytes at a time, which is 128 pages
+     * per read() with the default 1MB buffer instead of one.
+     */
+
+    if (verbose)
+        printf("DEBUG: scanning segment filename: %s/%s [%u, %u)\n",
+            dirpath, filename, startblk, endblk);
+
+    int fd;
+    char *path;
+    uint64 corrupted;
+    ScanStats before = io->stats;
+    SegmentFile file;
+
+    file.filename = filename;
+    file.dirpath = dirpath;
+    file.url = url;
+    file.fd = -1;
+    file.segmentNumber = parse_segment_number(filename);
+    file.segmentBlockOffset = segment_blocks * file.segmentNumber;
+    file.record = record;
+    file.db = db;
+
+    io->digest = 0;
+    io->counted = 0;
+    if (url != NULL)
+        corrupted = read_range_http(&file, startblk, endblk, io);
+    else
+    {
+        path = psprintf("%s/%s", dirpath, filename);
+
+        /* O_DIRECT reads bypass the page cache, so a scan of a live server
+         * does not push its working set out.  File systems such as tmpfs
+         * refuse it, those files are read through the cache instead.
+         */
+        fd = -1;
+        if (direct_io)
+        {
+            fd = open(path, O_RDONLY | O_DIRECT);
+            if (fd < 0 && errno == EINVAL &&
+                __sync_bool_compare_and_swap(&direct_io_warned, 0, 1))
+                fprintf(stderr, "WARNING: %s does not support O_DIRECT, "
+                    "reading through the page cache\n", path);
+        }
+        io->drop_cache = fd < 0 && fadvise_cache;
+        if (fd < 0)
+            fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "ERROR: %s: %s cannot be opened\n",
+                strerror(errno), path);
+            free(path);
+            /* return 1 so that other segment files can be scanned, but that
+             * this segment file is marked as corrupted/some unknown error
+             */
+            if (record != NULL)
+                __sync_fetch_and_add(&record->corrupted, 1);
+            count_corruption(1);
+            return 1;
+        }
+        free(path);
+        file.fd = fd;
+
+        if (io->drop_cache)
+        {
+            struct stat statbuf;
+            off_t start = (off_t) startblk * page_size;
+            off_t end = (off_t) endblk * page_size;
+
+            if (fstat(fd, &statbuf) < 0 || statbuf.st_size < start)
+                end = start;
+            else if (endblk == InvalidBlockNumber || statbuf.st_size < end)
+                end = statbuf.st_size;
+            note_cache_residency(fd, start, end - start, io);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        if (sample_percent > 0 || sample_pages > 0)
+            corrupted = read_range_sample(fd, &file, startblk, endblk, io);
+        else if (use_mmap)
+            corrupted = read_range_mmap(fd, &file, startblk, endblk, io);
+#ifdef USE_IO_URING
+        else if (io->uring != NULL)
+            corrupted = read_range_uring(fd, &file, startblk, endblk, io);
+#endif
+        else
+            corrupted = read_range_sync(fd, &file, startblk, endblk, io);
+
+        if (io->drop_cache)
+            drop_cached_range(fd, io->resident_base +
+                (off_t) io->resident_pages * os_page_size, true, io);
+        close(fd);
+    }
+    /* read errors are not seen by verify_buffer() */
+    count_corruption(corrupted - io->counted);
+
+    if (file.record != NULL)
+    {
+        __sync_fetch_and_add(&file.record->corrupted, corrupted);
+        __sync_fetch_and_add(&file.record->digest, io->digest);
+    }
+
+    if (startblk == 0)
+        STATS_ADD(io->stats.files, 1);
+    if (file.db != NULL)
+        add_database_stats(file.db, &before, &io->stats);
+
+    return corrupted;
+}
+
+static uint64
+scan_segmentfile(const char *filename, const char *dirpath, FileRecord *record,
+    DatabaseStats *db)
+{
+    return scan_segment_range(filename, dirpath, NULL, 0, InvalidBlockNumber,
+        record, db, &scan_io);
+}
+
+static size_t
+manifest_hash(const char *path)
+{
+    /* FNV-1a over the relative path */
+    size_t hash = 2166136261u;
+
+    while (*path)
+    {
+        hash ^= (unsigned char) *path++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static FileRecord *
+manifest_lookup(const char *path)
+{
+    size_t i;
+
+    if (manifest.nslots == 0)
+        return NULL;
+
+    for (i = manifest_hash(path) & (manifest.nslots - 1);
+         manifest.slots[i] != NULL;
+         i = (i + 1) & (manifest.nslots - 1))
+    {
+        if (strcmp(manifest.slots[i]->path, path) == 0)
+            return manifest.slots[i];
+    }
+
+    return NULL;
+}
+
+static FileRecord *
+new_file_record(const char *path)
+{
+    size_t len = strlen(path) + 1;
+    FileRecord *record = calloc(1, sizeof(FileRecord) + len);
+
+    if (record == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory recording %s\n", path);
+        exit(1);
+    }
+    record->path = (char *) (record + 1);
+    memcpy(record->path, path, len);
+
+    return record;
+}
+
+static void
+load_manifest(const char *filename)
+{
+    /* Reads the manifest written by a previous run into a hash table keyed
+     * by path.  A missing manifest is not an error, it is created at the end
+     * of the first run; lines that cannot be parsed are ignored, those files
+     * are simply verified again.
+     */
+    FILE *fp;
+    char *line = NULL;
+    size_t linesize = 0;
+    char *path = NULL;
+    unsigned long long size, sec, nsec, inode, digest;
+    unsigned long long corrupted;
+    FileRecord **records = NULL;
+    size_t nrecords = 0;
+    size_t maxrecords = 0;
+    size_t i, slot;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        if (errno != ENOENT)
+            fprintf(stderr, "WARNING: %s: manifest %s cannot be read, "
+                "verifying all segment files\n", strerror(errno), filename);
+        return;
+    }
+
+    while (getline(&line, &linesize, fp) > 0)
+    {
+        FileRecord *record;
+
+        if (line[0] == '#')
+            continue;
+        /* the path cannot be longer than the line it is read from */
+        free(path);
+        path = malloc(strlen(line) + 1);
+        if (path == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory reading manifest %s\n",
+                filename);
+            exit(1);
+        }
+        if (sscanf(line, "%[^\t]\t%llu\t%llu.%llu\t%llu\t%llx\t%llu",
+                path, &size, &sec, &nsec, &inode, &digest, &corrupted) != 7)
+            continue;
+
+        record = new_file_record(path);
+        record->size = size;
+        record->mtime.tv_sec = sec;
+        record->mtime.tv_nsec = nsec;
+        record->inode = inode;
+        record->digest = digest;
+        record->corrupted = corrupted;
+
+        if (nrecords == maxrecords)
+        {
+            maxrecords = maxrecords ? maxrecords * 2 : 1024;
+            records = realloc(records, maxrecords * sizeof(FileRecord *));
+            if (records == NULL)
+            {
+                fprintf(stderr, "ERROR: out of memory reading manifest %s\n",
+                    filename);
+                exit(1);
+            }
+        }
+        records[nrecords++] = record;
+    }
+    fclose(fp);
+    free(line);
+    free(path);
+
+    /* open addressing table kept at most half full */
+    manifest.nslots = 16;
+    while (manifest.nslots < nrecords * 2)
+        manifest.nslots *= 2;
+    manifest.slots = calloc(manifest.nslots, sizeof(FileRecord *));
+    if (manifest.slots == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory reading manifest %s\n",
+            filename);
+        exit(1);
+    }
+    for (i = 0; i < nrecords; i++)
+    {
+        slot = manifest_hash(records[i]->path) & (manifest.nslots - 1);
+        while (manifest.slots[slot] != NULL)
+            slot = (slot + 1) & (manifest.nslots - 1);
+        manifest.slots[slot] = records[i];
+    }
+    free(records);
+}
+
+static void
+append_file_record(FileRecord *record)
+{
+    pthread_mutex_lock(&walk_lock);
+    if (manifest.nrecords == manifest.maxrecords)
+    {
+        manifest.maxrecords = manifest.maxrecords ? manifest.maxrecords * 2 : 1024;
+        manifest.records = realloc(manifest.records,
+            manifest.maxrecords * sizeof(FileRecord *));
+        if (manifest.records == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory recording %s\n",
+                record->path);
+            exit(1);
+        }
+    }
+    manifest.records[manifest.nrecords++] = record;
+    pthread_mutex_unlock(&walk_lock);
+}
+
+static FileRecord *
+manifest_record(const char *filename, const char *dirpath,
+    const struct stat *statbuf, bool *unchanged)
+{
+    /* Creates the record of a segment file for the manifest of this run.
+     * unchanged is set if the previous run verified the file without
+     * finding corruption and its size, mtime and inode are still the same,
+     * the file then does not have to be read again.  Files that were
+     * corrupted are always verified again so that the result of the run
+     * stays the same as that of a full scan.
+     */
+    char *path;
+    FileRecord *record;
+    FileRecord *previous;
+
+    path = psprintf("%s/%s", dirpath + manifest.prefix_len, filename);
+    record = new_file_record(path);
+    record->size = statbuf->st_size;
+    record->mtime = statbuf->st_mtim;
+    record->inode = statbuf->st_ino;
+
+    previous = manifest_lookup(path);
+    *unchanged = !force_full && previous != NULL &&
+        previous->corrupted == 0 &&
+        previous->size == record->size &&
+        previous->inode == record->inode &&
+        previous->mtime.tv_sec == record->mtime.tv_sec &&
+        previous->mtime.tv_nsec == record->mtime.tv_nsec;
+    if (*unchanged)
+        record->digest = previous->digest;
+
+    /* the previous manifest is only read here, this run's is appended to */
+    pthread_mutex_lock(&walk_lock);
+    if (*unchanged)
+        manifest.skipped++;
+    pthread_mutex_unlock(&walk_lock);
+    append_file_record(record);
+    free(path);
+
+    return record;
+}
+
+static void
+write_manifest(const char *filename)
+{
+    /* Written to a temporary file and renamed over the old manifest so that
+     * an interrupted run leaves the previous manifest intact.
+     */
+    char *tmpname;
+    FILE *fp;
+    size_t i;
+
+    tmpname = psprintf("%s.tmp", filename);
+    fp = fopen(tmpname, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "WARNING: %s: manifest %s cannot be written\n",
+            strerror(errno), tmpname);
+        free(tmpname);
+        return;
+    }
+
+    fprintf(fp, "# pg_page_verification manifest, path size mtime inode "
+        "digest corrupted\n");
+    for (i = 0; i < manifest.nrecords; i++)
+    {
+        FileRecord *record = manifest.records[i];
+
+        fprintf(fp, "%s\t%llu\t%llu.%09llu\t%llu\t%016llx\t%llu\n",
+            record->path,
+            (unsigned long long) record->size,
+            (unsigned long long) record->mtime.tv_sec,
+            (unsigned long long) record->mtime.tv_nsec,
+            (unsigned long long) record->inode,
+            (unsigned long long) record->digest,
+            (unsigned long long) record->corrupted);
+    }
+
+    if (fclose(fp) != 0 || rename(tmpname, filename) != 0)
+        fprintf(stderr, "WARNING: %s: manifest %s cannot be written\n",
+            strerror(errno), filename);
+    free(tmpname);
+
+    if (verbose)
+        printf("DEBUG: manifest %s: %zu segment files, %zu unchanged "
+            "since the last run\n", filename, manifest.nrecords,
+            manifest.skipped);
+}
+
+/* --digests writes a header of DIGEST_MAGIC, the format version, the page
+ * size, the blocks per segment and the number of records, then a record
+ * per segment file verified, sorted by path: its digest, see page_digest(),
+ * its size and its corrupt pages, the length of its path relative to the
+ * data directory and the path itself.  Integers are little endian, 32 bit
+ * in the header but for the number of records, 64 bit in the records but
+ * for the 16 bit path length.  --compare-digests reads it back.
+ */
+#define DIGEST_MAGIC "PGVDIGST"
+#define DIGEST_VERSION 1
+#define DIGEST_HEADER_SIZE 28
+#define DIGEST_RECORD_SIZE 26
+
+static void
+put_le(unsigned char *out, uint64 value, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        out[i] = (unsigned char) (value >> (8 * i));
+}
+
+static uint64
+get_le(const unsigned char *in, int len)
+{
+    uint64 value = 0;
+    int i;
+
+    for (i = len - 1; i >= 0; i--)
+        value = (value << 8) | in[i];
+
+    return value;
+}
+
+static int
+compare_file_records(const void *a, const void *b)
+{
+    return strcmp((*(FileRecord * const *) a)->path,
+        (*(FileRecord * const *) b)->path);
+}
+
+static void
+write_digests(const char *filename)
+{
+    /* written and renamed like the manifest */
+    unsigned char header[DIGEST_HEADER_SIZE];
+    unsigned char fixed[DIGEST_RECORD_SIZE];
+    char *tmpname;
+    FILE *fp;
+    size_t len;
+    size_t i;
+
+    qsort(manifest.records, manifest.nrecords, sizeof(FileRecord *),
+        compare_file_records);
+
+    tmpname = psprintf("%s.tmp", filename);
+    fp = fopen(tmpname, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "WARNING: %s: digests %s cannot be written\n",
+            strerror(errno), tmpname);
+        free(tmpname);
+        return;
+    }
+
+    memcpy(header, DIGEST_MAGIC, 8);
+    put_le(header + 8, DIGEST_VERSION, 4);
+    put_le(header + 12, page_size, 4);
+    put_le(header + 16, segment_blocks, 4);
+    put_le(header + 20, manifest.nrecords, 8);
+    fwrite(header, sizeof(header), 1, fp);
+    for (i = 0; i < manifest.nrecords; i++)
+    {
+        FileRecord *record = manifest.records[i];
+
+        len = strlen(record->path);
+        put_le(fixed, record->digest, 8);
+        put_le(fixed + 8, record->size, 8);
+        put_le(fixed + 16, record->corrupted, 8);
+        put_le(fixed + 24, len, 2);
+        fwrite(fixed, sizeof(fixed), 1, fp);
+        fwrite(record->path, len, 1, fp);
+    }
+
+    if (ferror(fp) || fclose(fp) != 0 || rename(tmpname, filename) != 0)
+        fprintf(stderr, "WARNING: %s: digests %s cannot be written\n",
+            strerror(errno), filename);
+    free(tmpname);
+
+    if (verbose)
+        printf("DEBUG: digests %s: %zu segment files\n", filename,
+            manifest.nrecords);
+}
+
+static uint64
+compare_digests(const char *filename)
+{
+    /* Compares the digests of this run with those of --digests written by
+     * another, of the primary a backup was taken from for instance.  Files
+     * that differ or that are missing here are counted and returned, files
+     * only found here are reported as such, a relation may have been
+     * created since.
+     */
+    unsigned char header[DIGEST_HEADER_SIZE];
+    unsigned char fixed[DIGEST_RECORD_SIZE];
+    FILE *fp;
+    char path[65536];
+    uint64 nrecords;
+    uint64 digest = 0;
+    uint64 size = 0;
+    uint64 read_records = 0;
+    uint64 differ = 0;
+    uint64 missing = 0;
+    uint64 extra = 0;
+    size_t len;
+    size_t i = 0;
+    int cmp;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "ERROR: %s: digests %s cannot be read\n",
+            strerror(errno), filename);
+        return 1;
+    }
+    if (fread(header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header, DIGEST_MAGIC, 8) != 0 ||
+        get_le(header + 8, 4) != DIGEST_VERSION)
+    {
+        fprintf(stderr, "ERROR: %s is not a digest file of this version\n",
+            filename);
+        fclose(fp);
+        return 1;
+    }
+    if (get_le(header + 12, 4) != page_size ||
+        get_le(header + 16, 4) != segment_blocks)
+    {
+        fprintf(stderr, "ERROR: %s was written for %llu byte pages and %llu "
+            "blocks per segment, not %u and %u\n", filename,
+            (unsigned long long) get_le(header + 12, 4),
+            (unsigned long long) get_le(header + 16, 4),
+            page_size, segment_blocks);
+        fclose(fp);
+        return 1;
+    }
+    nrecords = get_le(header + 20, 8);
+
+    /* both lists are sorted by path, merge them */
+    qsort(manifest.records, manifest.nrecords, sizeof(FileRecord *),
+        compare_file_records);
+    for (;;)
+    {
+        if (read_records < nrecords)
+        {
+            if (fread(fixed, sizeof(fixed), 1, fp) != 1)
+                break;
+            len = get_le(fixed + 24, 2);
+            if (fread(path, 1, len, fp) != len)
+                break;
+            path[len] = '\0';
+            digest = get_le(fixed, 8);
+            size = get_le(fixed + 8, 8);
+            read_records++;
+        }
+        else
+            path[0] = '\0';
+
+        for (;;)
+        {
+            cmp = i == manifest.nrecords ? 1 :
+                path[0] == '\0' ? -1 :
+                strcmp(manifest.records[i]->path, path);
+            if (cmp >= 0)
+                break;
+            fprintf(stderr, "WARNING: %s is not in %s\n",
+                manifest.records[i]->path, filename);
+            extra++;
+            i++;
+        }
+        if (path[0] == '\0')
+            break;
+
+        if (cmp > 0)
+        {
+            fprintf(stderr, "ERROR: %s is in %s but was not found\n", path,
+                filename);
+            missing++;
+        }
+        else
+        {
+            FileRecord *record = manifest.records[i++];
+
+            if ((uint64) record->size != size)
+            {
+                fprintf(stderr, "ERROR: %s differs from %s, %llu bytes "
+                    "instead of %llu\n", path, filename,
+                    (unsigned long long) record->size,
+                    (unsigned long long) size);
+                differ++;
+            }
+            else if (record->digest != digest)
+            {
+                fprintf(stderr, "ERROR: %s differs from %s\n", path,
+                    filename);
+                differ++;
+            }
+        }
+    }
+    if (read_records < nrecords)
+    {
+        fprintf(stderr, "ERROR: %s ends after %llu of %llu records\n",
+            filename, (unsigned long long) read_records,
+            (unsigned long long) nrecords);
+        missing++;
+    }
+    fclose(fp);
+
+    printf("DIGESTS: %llu segment files compared, %llu differ, %llu "
+        "missing, %llu not in %s\n", (unsigned long long) nrecords,
+        (unsigned long long) differ, (unsigned long long) missing,
+        (unsigned long long) extra, filename);
+
+    return differ + missing;
+}
+
+static void
+deque_push(TaskDeque *queue, ScanTask *task)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity)
+    {
+        /* reclaim the slots already stolen from the head before growing */
+        if (queue->head > 0)
+        {
+            memmove(queue->tasks, &queue->tasks[queue->head],
+                (queue->tail - queue->head) * sizeof(ScanTask *));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        if (queue->tail == queue->capacity)
+        {
+            queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+            queue->tasks = realloc(queue->tasks,
+                queue->capacity * sizeof(ScanTask *));
+            if (queue->tasks == NULL)
+            {
+                fprintf(stderr, "ERROR: out of memory queueing %s\n",
+                    task->dirpath);
+                exit(1);
+            }
+        }
+    }
+    queue->tasks[queue->tail++] = task;
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.queued++;
+    pthread_cond_signal(&pool.wakeup);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static ScanTask *
+deque_take(TaskDeque *queue, bool steal)
+{
+    ScanTask *task = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
+    {
+        if (steal)
+            task = queue->tasks[queue->head++];
+        else
+            task = queue->tasks[--queue->tail];
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (task != NULL)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pool.queued--;
+        pool.active++;
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    return task;
+}
+
+static ScanTask *
+next_task(ScanWorker *worker)
+{
+    ScanTask *task;
+    int i;
+
+    task = deque_take(&worker->queue, false);
+
+    /* the segment files, largest first, once the walk is over */
+    if (task == NULL)
+        task = deque_take(&pool.plan, true);
+
+    /* own queue is empty, try to steal from the others starting with the
+     * neighbour so that thieves spread out over the pool
+     */
+    for (i = 1; task == NULL && i < num_workers; i++)
+        task = deque_take(&pool.workers[(worker->id + i) % num_workers].queue,
+            true);
+
+    return task;
+}
+
+/* workers walk the directories queued by scan_directory() */
+static uint64 scan_directory(const char *dirpath);
+
+/* Placement of the workers with --numa.  Each worker is pinned to one CPU
+ * of the nodes chosen, among those the process may run on, and allocates
+ * its read buffers itself once pinned, bound to the node of its CPU, so
+ * that pages are read into and checksummed from memory local to the
+ * worker.  The same buffers serve every segment file the worker scans.
+ * Nodes are found in sysfs and memory is bound with the mbind system call,
+ * libnuma is not needed.
+ */
+#define MAX_NUMA_NODES 64
+#define MPOL_PREFERRED_MODE 1   /* MPOL_PREFERRED of <numaif.h> */
+#define MPOL_MF_MOVE_FLAG 2     /* MPOL_MF_MOVE */
+
+static struct
+{
+    int        *cpus;           /* per worker */
+    int        *nodes;
+} numa_placement;
+
+static bool
+read_cpulist(const char *path, const cpu_set_t *allowed, cpu_set_t *cpus)
+{
+    /* the CPUs of a sysfs list such as 0-3,8-11 that are also allowed */
+    char list[4096];
+    char *p;
+    char *end;
+    long first, last;
+    FILE *fp = fopen(path, "r");
+
+    CPU_ZERO(cpus);
+    if (fp == NULL)
+        return false;
+    if (fgets(list, sizeof(list), fp) == NULL)
+        list[0] = '\0';
+    fclose(fp);
+
+    for (p = list; isdigit((unsigned char) *p); p = end + (*end == ','))
+    {
+        first = last = strtol(p, &end, 10);
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (; first <= last && first < CPU_SETSIZE; first++)
+            if (CPU_ISSET(first, allowed))
+                CPU_SET(first, cpus);
+    }
+
+    return true;
+}
+
+static int
+device_numa_node(const char *datadir)
+{
+    /* The node of the device datadir is on, -1 if unknown.  The numa_node
+     * attribute belongs to the PCI device, above the disk and partition in
+     * the sysfs path of the block device.
+     */
+    struct stat statbuf;
+    char *link;
+    char *path;
+    char *slash;
+    char *attr;
+    FILE *fp;
+    int node = -1;
+
+    if (stat(datadir, &statbuf) < 0)
+        return -1;
+    link = psprintf("/sys/dev/block/%u:%u", major(statbuf.st_dev),
+        minor(statbuf.st_dev));
+    path = realpath(link, NULL);
+    free(link);
+    if (path == NULL)
+        return -1;
+
+    while (node < 0 && strncmp(path, "/sys/devices/", 13) == 0)
+    {
+        attr = psprintf("%s/numa_node", path);
+        fp = fopen(attr, "r");
+        if (fp != NULL)
+        {
+            if (fscanf(fp, "%d", &node) != 1)
+                node = -1;
+            fclose(fp);
+        }
+        free(attr);
+        slash = strrchr(path, '/');
+        *slash = '\0';
+    }
+    free(path);
+
+    return node;
+}
+
+static void
+plan_numa_placement(const char *datadir)
+{
+    /* worker i goes to node i modulo the number of nodes chosen, and to
+     * the next CPU of that node, round robin
+     */
+    cpu_set_t allowed;
+    cpu_set_t node_cpus[MAX_NUMA_NODES];
+    int nodes[MAX_NUMA_NODES];
+    int nnodes = 0;
+    int node = -1;
+    int first, last;
+    int i, n, cpu;
+    char *path;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        fprintf(stderr, "WARNING: %s: CPU affinity unknown, workers are "
+            "not pinned\n", strerror(errno));
+        return;
+    }
+
+    if (strcmp(numa_mode, "device") == 0)
+    {
+        node = device_numa_node(datadir);
+        if (node < 0)
+            fprintf(stderr, "WARNING: NUMA node of the device of %s unknown, "
+                "spreading workers over all nodes\n", datadir);
+    }
+    else if (strcmp(numa_mode, "spread") != 0)
+        node = atoi(numa_mode);
+    first = node < 0 ? 0 : node;
+    last = node < 0 ? MAX_NUMA_NODES - 1 : node;
+
+    for (n = first; n <= last && n < MAX_NUMA_NODES; n++)
+    {
+        path = psprintf("/sys/devices/system/node/node%d/cpulist", n);
+        if (read_cpulist(path, &allowed, &node_cpus[nnodes]) &&
+            CPU_COUNT(&node_cpus[nnodes]) > 0)
+            nodes[nnodes++] = n;
+        free(path);
+    }
+    if (nnodes == 0)
+    {
+        fprintf(stderr, "WARNING: no usable CPUs found on NUMA node%s %s, "
+            "workers are not pinned\n", node < 0 ? "s" : "",
+            node < 0 ? "in sysfs" : numa_mode);
+        return;
+    }
+
+    numa_placement.cpus = malloc(num_workers * sizeof(int));
+    numa_placement.nodes = malloc(num_workers * sizeof(int));
+    if (numa_placement.cpus == NULL || numa_placement.nodes == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory placing workers\n");
+        exit(1);
+    }
+    for (i = 0; i < num_workers; i++)
+    {
+        n = i % nnodes;
+        cpu = -1;
+        first = (i / nnodes) % CPU_COUNT(&node_cpus[n]);
+        while (first >= 0)
+            if (CPU_ISSET(++cpu, &node_cpus[n]))
+                first--;
+        numa_placement.cpus[i] = cpu;
+        numa_placement.nodes[i] = nodes[n];
+        if (verbose)
+            printf("DEBUG: worker %d on CPU %d of NUMA node %d\n", i, cpu,
+                nodes[n]);
+    }
+}
+
+static void
+place_worker(ScanWorker *worker)
+{
+    /* Runs on the worker before it allocates anything.  Memory is only
+     * preferred from the node, not bound to it, so that a node short of
+     * memory slows the scan down instead of failing it.
+     */
+    cpu_set_t cpus;
+    unsigned long nodemask;
+    size_t len;
+    int error;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0)
+        fprintf(stderr, "WARNING: %s: worker %d cannot be pinned to CPU %d\n",
+            strerror(error), worker->id, worker->cpu);
+
+    init_scan_io(&worker->io);
+
+    len = read_buffer_size;
+#ifdef USE_IO_URING
+    if (worker->io.uring != NULL)
+        len *= io_depth;
+#endif
+    nodemask = 1UL << worker->node;
+    if (syscall(SYS_mbind, worker->io.buffer, len, MPOL_PREFERRED_MODE,
+            &nodemask, (unsigned long) MAX_NUMA_NODES + 1,
+            MPOL_MF_MOVE_FLAG) < 0 && verbose)
+        printf("DEBUG: %s: buffers of worker %d are not bound to node %d\n",
+            strerror(errno), worker->id, worker->node);
+
+    /* fault the buffers in on their node now rather than in the first read */
+    memset(worker->io.buffer, 0, len);
+}
+
+static void *
+scan_worker(void *arg)
+{
+    ScanWorker *worker = (ScanWorker *) arg;
+    ScanTask *task;
+    ScanTask *next;
+    uint64 corrupted;
+    bool done = false;
+
+    current_worker = worker;
+    if (worker->cpu >= 0)
+        place_worker(worker);
+    else
+        init_scan_io(&worker->io);
+    while (!done)
+    {
+        task = next_task(worker);
+        if (task != NULL)
+        {
+            /* a task without a file name is a directory to walk, the files
+             * of a batch follow each other through next
+             */
+            for (; task != NULL; task = next)
+            {
+                next = task->next;
+                current_cluster = task->cluster;
+                if (scan_stopped())
+                    corrupted = 0;
+                else if (task->filename == NULL)
+                    corrupted = scan_directory(task->dirpath);
+                else
+                    corrupted = scan_segment_range(task->filename,
+                        task->dirpath, task->url, task->startblk,
+                        task->endblk, task->record, task->db, &worker->io);
+                worker->corrupted += corrupted;
+                if (task->cluster != NULL)
+                    __sync_fetch_and_add(&task->cluster->corrupted,
+                        corrupted);
+                free(task);
+            }
+
+            pthread_mutex_lock(&pool.lock);
+            pool.active--;
+            if (pool.active == 0 && pool.queued == 0)
+            {
+                pthread_cond_signal(&pool.idle);
+                if (pool.walk_done)
+                    pthread_cond_broadcast(&pool.wakeup);
+            }
+            pthread_mutex_unlock(&pool.lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        while (pool.queued == 0 && !(pool.walk_done && pool.active == 0))
+            pthread_cond_wait(&pool.wakeup, &pool.lock);
+        done = (pool.queued == 0 && pool.walk_done && pool.active == 0);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    return NULL;
+}
+
+static void
+queue_task(ScanTask *task)
+{
+    /* Work found by a worker goes to its own deque, where it is picked up
+     * last in first out and stolen by idle workers; the main thread hands
+     * out work round robin, stealing evens out the rest.  Segment files
+     * wait for the end of the walk in the plan.
+     */
+    task->cluster = current_cluster;
+    if (task->filename != NULL)
+    {
+        pthread_mutex_lock(&pool.lock);
+        if (pool.nplanned == pool.planned_capacity)
+        {
+            pool.planned_capacity = pool.planned_capacity ?
+                pool.planned_capacity * 2 : 1024;
+            pool.planned = realloc(pool.planned,
+                pool.planned_capacity * sizeof(ScanTask *));
+            if (pool.planned == NULL)
+            {
+                fprintf(stderr, "ERROR: out of memory queueing %s/%s\n",
+                    task->dirpath, task->filename);
+                exit(1);
+            }
+        }
+        pool.planned[pool.nplanned++] = task;
+        pthread_mutex_unlock(&pool.lock);
+    }
+    else if (current_worker != NULL)
+        deque_push(&current_worker->queue, task);
+    else
+    {
+        deque_push(&pool.workers[pool.next_worker].queue, task);
+        pool.next_worker = (pool.next_worker + 1) % num_workers;
+    }
+}
+
+static void
+queue_directory(const char *dirpath)
+{
+    size_t dirlen = strlen(dirpath) + 1;
+    ScanTask *task = calloc(1, sizeof(ScanTask) + dirlen);
+
+    if (task == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory queueing %s\n", dirpath);
+        exit(1);
+    }
+    memcpy(task + 1, dirpath, dirlen);
+    task->dirpath = (char *) (task + 1);
+    queue_task(task);
+}
+
+static void
+queue_segment_range(const char *filename, const char *dirpath,
+    const char *url, BlockNumber startblk, BlockNumber endblk,
+    BlockNumber nblocks, FileRecord *record, DatabaseStats *db)
+{
+    /* nblocks is the number of blocks the range is expected to have, the
+     * file may still grow or shrink before it is scanned
+     */
+    size_t dirlen = strlen(dirpath) + 1;
+    size_t namelen = strlen(filename) + 1;
+    size_t urllen = url != NULL ? strlen(url) + 1 : 0;
+    ScanTask *task;
+    char *strings;
+
+    task = malloc(sizeof(ScanTask) + dirlen + namelen + urllen);
+    if (task == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory queueing %s/%s\n",
+            dirpath, filename);
+        exit(1);
+    }
+    strings = (char *) (task + 1);
+    memcpy(strings, dirpath, dirlen);
+    memcpy(strings + dirlen, filename, namelen);
+    task->dirpath = strings;
+    task->filename = strings + dirlen;
+    task->url = NULL;
+    if (url != NULL)
+    {
+        memcpy(strings + dirlen + namelen, url, urllen);
+        task->url = strings + dirlen + namelen;
+    }
+    task->startblk = startblk;
+    task->endblk = endblk;
+    task->record = record;
+    task->db = db;
+    task->nblocks = nblocks;
+    task->next = NULL;
+
+    queue_task(task);
+}
+
+static void
+queue_segmentfile(const char *filename, const char *dirpath,
+    const char *url, off_t size, FileRecord *record, DatabaseStats *db)
+{
+    BlockNumber nblocks = size / page_size;
+    BlockNumber startblk;
+
+    /* a sampling scan reads too few pages of a file to be worth splitting
+     * it, and --sample-pages counts pages per segment file
+     */
+    if (nblocks <= SCAN_TASK_BLOCKS || sample_percent > 0 || sample_pages > 0)
+    {
+        queue_segment_range(filename, dirpath, url, 0, InvalidBlockNumber,
+            nblocks, record, db);
+        return;
+    }
+
+    /* the last range is left open ended so that pages appended while the
+     * scan runs are still checked, as they are by the serial scan
+     */
+    for (startblk = 0; startblk < nblocks; startblk += SCAN_TASK_BLOCKS)
+        queue_segment_range(filename, dirpath, url, startblk,
+            startblk + SCAN_TASK_BLOCKS < nblocks ?
+            startblk + SCAN_TASK_BLOCKS : InvalidBlockNumber,
+            nblocks - startblk < SCAN_TASK_BLOCKS ?
+            nblocks - startblk : SCAN_TASK_BLOCKS, record, db);
+}
+
+static int
+compare_planned_tasks(const void *a, const void *b)
+{
+    /* largest first, the ranges of a file in order */
+    const ScanTask *task_a = *(ScanTask * const *) a;
+    const ScanTask *task_b = *(ScanTask * const *) b;
+    int cmp;
+
+    if (task_a->nblocks != task_b->nblocks)
+        return task_a->nblocks > task_b->nblocks ? -1 : 1;
+    cmp = strcmp(task_a->dirpath, task_b->dirpath);
+    if (cmp == 0)
+        cmp = strcmp(task_a->filename, task_b->filename);
+    if (cmp == 0 && task_a->startblk != task_b->startblk)
+        cmp = task_a->startblk < task_b->startblk ? -1 : 1;
+
+    return cmp;
+}
+
+static void
+schedule_plan(void)
+{
+    /* Waits for the walk to end and hands out the segment files it found,
+     * largest first.  Every worker takes the largest task left whenever it
+     * is idle, so that a scan does not end waiting on one worker still
+     * reading a large file started last.  Small files are packed, in that
+     * same order, into batches handed out together, small enough that the
+     * batches still spread over all workers.
+     */
+    ScanTask *last = NULL;
+    uint64 total = 0;
+    uint64 batch_blocks;
+    size_t ntasks = 0;
+    size_t nfiles = 0;
+    size_t i;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.queued > 0 || pool.active > 0)
+        pthread_cond_wait(&pool.idle, &pool.lock);
+
+    qsort(pool.planned, pool.nplanned, sizeof(ScanTask *),
+        compare_planned_tasks);
+    for (i = 0; i < pool.nplanned; i++)
+        total += pool.planned[i]->nblocks;
+    batch_blocks = total / ((uint64) num_workers * SCAN_BATCHES_PER_WORKER);
+    if (batch_blocks > SCAN_TASK_BLOCKS)
+        batch_blocks = SCAN_TASK_BLOCKS;
+
+    for (i = 0; i < pool.nplanned; i++)
+    {
+        ScanTask *task = pool.planned[i];
+        ScanTask *head = ntasks > 0 ? pool.planned[ntasks - 1] : NULL;
+
+        if (head != NULL &&
+            (uint64) head->nblocks + task->nblocks <= batch_blocks &&
+            nfiles < SCAN_BATCH_FILES)
+        {
+            head->nblocks += task->nblocks;
+            last->next = task;
+            nfiles++;
+        }
+        else
+        {
+            pool.planned[ntasks++] = task;
+            nfiles = 1;
+        }
+        last = task;
+    }
+    /* batches may have grown larger than the files after them */
+    qsort(pool.planned, ntasks, sizeof(ScanTask *), compare_planned_tasks);
+
+    if (verbose)
+        printf("DEBUG: scanning %zu segment ranges in %zu tasks, largest "
+            "first\n", pool.nplanned, ntasks);
+
+    pthread_mutex_lock(&pool.plan.lock);
+    pool.plan.tasks = pool.planned;
+    pool.plan.capacity = pool.planned_capacity;
+    pool.plan.head = 0;
+    pool.plan.tail = ntasks;
+    pthread_mutex_unlock(&pool.plan.lock);
+    pool.planned = NULL;
+    pool.nplanned = 0;
+    pool.planned_capacity = 0;
+
+    pool.queued += ntasks;
+    pthread_cond_broadcast(&pool.wakeup);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void
+start_workers(void)
+{
+    int i;
+
+    pool.workers = calloc(num_workers, sizeof(ScanWorker));
+    if (pool.workers == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory starting %d workers\n",
+            num_workers);
+        exit(1);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wakeup, NULL);
+    pthread_cond_init(&pool.idle, NULL);
+    pthread_mutex_init(&pool.plan.lock, NULL);
+
+    /* Every deque is set up before any worker may steal from it.  Workers
+     * set up their own ScanIO, so that its memory is first touched by the
+     * thread using it.
+     */
+    for (i = 0; i < num_workers; i++)
+    {
+        pool.workers[i].id = i;
+        pool.workers[i].cpu = -1;
+        pool.workers[i].node = -1;
+        if (numa_placement.cpus != NULL)
+        {
+            pool.workers[i].cpu = numa_placement.cpus[i];
+            pool.workers[i].node = numa_placement.nodes[i];
+        }
+        pool.workers[i].io.worker = i;
+        pthread_mutex_init(&pool.workers[i].queue.lock, NULL);
+    }
+    for (i = 0; i < num_workers; i++)
+    {
+        if (pthread_create(&pool.workers[i].thread, NULL, scan_worker,
+                &pool.workers[i]) != 0)
+        {
+            fprintf(stderr, "ERROR: cannot start worker %d\n", i);
+            exit(1);
+        }
+    }
+}
+
+static uint64
+finish_workers(void)
+{
+    uint64 corrupted = 0;
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.walk_done = true;
+    pthread_cond_broadcast(&pool.wakeup);
+    pthread_mutex_unlock(&pool.lock);
+
+    /* a worker on its way out may still look into the other deques */
+    for (i = 0; i < num_workers; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+    for (i = 0; i < num_workers; i++)
+    {
+        corrupted += pool.workers[i].corrupted;
+        pthread_mutex_destroy(&pool.workers[i].queue.lock);
+        free(pool.workers[i].queue.tasks);
+        release_scan_io(&pool.workers[i].io);
+    }
+    free(pool.workers);
+    pthread_mutex_destroy(&pool.plan.lock);
+    free(pool.plan.tasks);
+    free(numa_placement.cpus);
+    free(numa_placement.nodes);
+
+    return corrupted;
+}
+
+static bool
+is_relation_file(const char *filename)
+{
+    /* Only relation segment files are made of checksummed pages, they are
+     * named <relfilenode>[_<fork>][.<segment>].  The free space map and
+     * visibility map forks are skipped since they can be regenerated, and
+     * reading them would be wasted I/O.  This also leaves out temporary
+     * relations (t<backend>_<relfilenode>), PG_VERSION, pg_filenode.map,
+     * pg_control and pg_internal.init, which always shows as corrupted and
+     * is recreated upon server startup.
+     */
+    const char *p = filename;
+
+    if (!isdigit((unsigned char) *p))
+        return false;
+    while (isdigit((unsigned char) *p))
+        p++;
+
+    if (*p == '_')
+    {
+        /* only the init fork of unlogged relations is kept */
+        if (strncmp(p, "_init", 5) != 0)
+            return false;
+        p += 5;
+    }
+
+    if (*p == '.')
+    {
+        p++;
+        if (!isdigit((unsigned char) *p))
+            return false;
+        while (isdigit((unsigned char) *p))
+            p++;
+    }
+
+    return *p == '\0';
+}
+
+/* --daemon verifies the cluster over and over, one pass at a time, and
+ * keeps a cursor in a file so that a restarted daemon resumes its pass.  A
+ * pass first verifies the segment files modified since the previous pass
+ * started, most recent first, as they hold the pages written since they
+ * were last verified, then all others in path order.  Files are verified
+ * DAEMON_STEP_BLOCKS at a time and the cursor advances by steps, it is
+ * saved every DAEMON_SAVE_SEC and when the daemon is stopped.
+ */
+#define DAEMON_STEP_BLOCKS 1024
+#define DAEMON_SAVE_SEC 10
+
+typedef struct PassFile
+{
+    char       *dirpath;
+    char       *relpath;    /* relative to the data directory */
+    const char *filename;   /* last component of relpath */
+    off_t       size;
+    time_t      mtime;
+} PassFile;
+
+static struct
+{
+    uint64      number;
+    time_t      start;          /* when the pass is due */
+    time_t      previous_start; /* files modified since are verified first */
+    PassFile   *files;
+    size_t      nfiles;
+    size_t      maxfiles;
+    char       *resume_path;    /* cursor, NULL at the start of the pass */
+    time_t      resume_mtime;
+    BlockNumber resume_block;
+} pass;
+
+static void
+add_pass_file(const char *filename, const char *dirpath,
+    const struct stat *statbuf)
+{
+    PassFile *file;
+
+    if (pass.nfiles == pass.maxfiles)
+    {
+        pass.maxfiles = pass.maxfiles ? pass.maxfiles * 2 : 1024;
+        pass.files = realloc(pass.files, pass.maxfiles * sizeof(PassFile));
+        if (pass.files == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory adding %s/%s to the pass\n",
+                dirpath, filename);
+            exit(1);
+        }
+    }
+
+    file = &pass.files[pass.nfiles++];
+    file->dirpath = psprintf("%s", dirpath);
+    file->relpath = psprintf("%s/%s", dirpath + manifest.prefix_len, filename);
+    file->filename = file->relpath + strlen(file->relpath) - strlen(filename);
+    file->size = statbuf->st_size;
+    file->mtime = statbuf->st_mtime;
+}
+
+static bool
+pass_file_recent(time_t mtime)
+{
+    /* Files modified while the pass runs keep their place in path order,
+     * so that the order is the same when a restarted daemon resumes.
+     */
+    return pass.previous_start > 0 && mtime >= pass.previous_start &&
+        mtime < pass.start;
+}
+
+static int
+compare_pass_order(const char *relpath_a, time_t mtime_a,
+    const char *relpath_b, time_t mtime_b)
+{
+    bool recent_a = pass_file_recent(mtime_a);
+    bool recent_b = pass_file_recent(mtime_b);
+
+    if (recent_a != recent_b)
+        return recent_a ? -1 : 1;
+    if (recent_a && mtime_a != mtime_b)
+        return mtime_a > mtime_b ? -1 : 1;
+    return strcmp(relpath_a, relpath_b);
+}
+
+static int
+compare_pass_files(const void *a, const void *b)
+{
+    const PassFile *file_a = (const PassFile *) a;
+    const PassFile *file_b = (const PassFile *) b;
+
+    return compare_pass_order(file_a->relpath, file_a->mtime,
+        file_b->relpath, file_b->mtime);
+}
+
+static void
+set_pass_cursor(const PassFile *file, BlockNumber blkno)
+{
+    free(pass.resume_path);
+    pass.resume_path = file == NULL ? NULL : psprintf("%s", file->relpath);
+    pass.resume_mtime = file == NULL ? 0 : file->mtime;
+    pass.resume_block = blkno;
+}
+
+static void
+save_cursor(void)
+{
+    /* renamed over the old cursor like the manifest */
+    char *tmpname;
+    FILE *fp;
+
+    tmpname = psprintf("%s.tmp", cursor_file);
+    fp = fopen(tmpname, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "WARNING: %s: cursor %s cannot be written\n",
+            strerror(errno), tmpname);
+        free(tmpname);
+        return;
+    }
+
+    fprintf(fp, "# pg_page_verification cursor, pass number start "
+        "previous_start, resume mtime block path\n");
+    fprintf(fp, "pass\t%llu\t%lld\t%lld\n",
+        (unsigned long long) pass.number,
+        (long long) pass.start,
+        (long long) pass.previous_start);
+    if (pass.resume_path != NULL)
+        fprintf(fp, "resume\t%lld\t%u\t%s\n",
+            (long long) pass.resume_mtime,
+            pass.resume_block,
+            pass.resume_path);
+
+    if (fclose(fp) != 0 || rename(tmpname, cursor_file) != 0)
+        fprintf(stderr, "WARNING: %s: cursor %s cannot be written\n",
+            strerror(errno), cursor_file);
+    free(tmpname);
+}
+
+static void
+load_cursor(void)
+{
+    /* A missing cursor starts the first pass, lines that cannot be parsed
+     * are ignored like those of the manifest.
+     */
+    FILE *fp;
+    char *line = NULL;
+    size_t linesize = 0;
+    unsigned long long number;
+    long long start, previous_start, mtime;
+    unsigned int blkno;
+    int pathpos;
+
+    fp = fopen(cursor_file, "r");
+    if (fp == NULL)
+    {
+        if (errno != ENOENT)
+            fprintf(stderr, "WARNING: %s: cursor %s cannot be read, starting "
+                "a new pass\n", strerror(errno), cursor_file);
+        return;
+    }
+
+    while (getline(&line, &linesize, fp) > 0)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "pass\t%llu\t%lld\t%lld", &number, &start,
+                &previous_start) == 3)
+        {
+            pass.number = number;
+            pass.start = start;
+            pass.previous_start = previous_start;
+        }
+        else if (sscanf(line, "resume\t%lld\t%u\t%n", &mtime, &blkno,
+                &pathpos) == 2 && line[pathpos] != '\0')
+        {
+            free(pass.resume_path);
+            pass.resume_path = psprintf("%s", line + pathpos);
+            pass.resume_mtime = mtime;
+            pass.resume_block = blkno;
+        }
+    }
+    fclose(fp);
+    free(line);
+}
+
+static void
+daemon_signal_handler(int signo)
+{
+    daemon_stop = 1;
+}
+
+static uint64
+scan_directory(const char *dirpath)
+{
+    /* Postgres stores data files in one directory per database defined,
+     * without additional nesting or leafs, under base, under the version
+     * directory of each tablespace, and directly in global for the shared
+     * catalogs.  This walks any such tree and verifies the relation files
+     * found, see is_relation_file().  Directories of temporary files used
+     * for queries in progress are not checked.
+     *
+     * Entries are told apart by the d_type readdir() returns where the file
+     * system fills it in.  A file is only stat'ed, relative to the open
+     * directory, when its size or metadata is needed: to split it between
+     * workers, to compare it against the manifest or to order a daemon pass.
+     *
+     * When running with several workers segment files and subdirectories
+     * are only queued here, so the database directories are walked by the
+     * workers in parallel and their corrupt pages counted there.
+     */
+
+    DIR *d;
+    struct dirent *dir;
+    struct stat statbuf;
+    uint64 corrupt_pages_found = 0;
+    DatabaseStats *db = NULL;
+    uint64 start = 0;
+    bool need_stat = num_workers > 1 || keep_records || cursor_file != NULL;
+    bool is_dir, is_reg;
+    int fd;
+
+    if (show_stats)
+        start = stats_clock();
+    fd = open(dirpath, O_RDONLY | O_DIRECTORY);
+    d = fd < 0 ? NULL : fdopendir(fd);
+    if (d == NULL && fd >= 0)
+        close(fd);
+    __sync_fetch_and_add(&scan_stats.dirs, 1);
+
+    if (verbose)
+        printf("DEBUG: called scan_directory(%s)\n", dirpath);
+
+    if (d)
+    {
+        for (;;)
+        {
+            /* only the metadata calls count towards the walk time, not the
+             * scanning of the segment files found
+             */
+            if (show_stats)
+                start = stats_clock();
+            dir = scan_stopped() ? NULL : readdir(d);
+            if (dir == NULL)
+                break;
+
+            is_dir = dir->d_type == DT_DIR;
+            is_reg = dir->d_type == DT_REG;
+            if (dir->d_type == DT_UNKNOWN || (is_reg && need_stat))
+            {
+                if (fstatat(dirfd(d), dir->d_name, &statbuf,
+                        AT_SYMLINK_NOFOLLOW) < 0)
+                    continue;
+                is_dir = S_ISDIR(statbuf.st_mode);
+                is_reg = S_ISREG(statbuf.st_mode);
+            }
+            if (show_stats)
+                __sync_fetch_and_add(&scan_stats.walk_ns,
+                    stats_clock() - start);
+
+            if (verbose)
+                printf("DEBUG: direntry: %s/%s - d_type: %d\n",
+                    dirpath, dir->d_name, dir->d_type);
+
+            if (is_dir)
+            {
+                char *path;
+
+                if(strcmp(".", dir->d_name) == 0 ||
+                    strcmp("..", dir->d_name) == 0)
+                    continue;
+
+                if (strncmp(dir->d_name, "pgsql_tmp", 9) == 0)
+                    continue;
+
+                path = psprintf("%s/%s", dirpath, dir->d_name);
+                if (num_workers > 1)
+                    queue_directory(path);
+                else
+                    corrupt_pages_found += scan_directory(path);
+                free(path);
+            }
+            else if (is_reg)
+            {
+                FileRecord *record = NULL;
+                bool unchanged = false;
+
+                if (!is_relation_file(dir->d_name))
+                {
+                    if (verbose)
+                        printf("DEBUG: skipping %s/%s, not a checksummed "
+                            "relation fork\n", dirpath, dir->d_name);
+                    continue;
+                }
+
+                __sync_fetch_and_add(&scan_stats.files, 1);
+                if (show_stats && db == NULL)
+                    db = new_database_stats(dirpath);
+
+                /* a daemon pass orders the files before verifying them */
+                if (cursor_file != NULL)
+                {
+                    add_pass_file(dir->d_name, dirpath, &statbuf);
+                    continue;
+                }
+
+                if (keep_records)
+                {
+                    record = manifest_record(dir->d_name, dirpath, &statbuf,
+                        &unchanged);
+                    if (unchanged)
+                    {
+                        if (verbose)
+                            printf("DEBUG: %s/%s unchanged since last verified\n",
+                                dirpath, dir->d_name);
+                        continue;
+                    }
+                }
+
+                if (num_workers > 1)
+                    queue_segmentfile(dir->d_name, dirpath, NULL,
+                        statbuf.st_size, record, db);
+                else
+                    corrupt_pages_found += scan_segmentfile(dir->d_name, dirpath,
+                        record, db);
+            }
+        }
+        if (show_stats)
+            __sync_fetch_and_add(&scan_stats.walk_ns, stats_clock() - start);
+        closedir(d);
+    }
+
+    return corrupt_pages_found;
+}
+
+static char *
+tablespace_version_path(const char *location)
+{
+    /* Clusters of different major versions can share a location, each in
+     * its own version directory, and pg_upgrade leaves the directory of the
+     * old cluster there until delete_old_cluster.sh is run.  Only the one of
+     * the cluster scanned is returned, NULL if there is none, the files of
+     * the others may not even have the same page size.
+     */
+    const char *version_dir = current_cluster != NULL ?
+        current_cluster->version_dir : TABLESPACE_VERSION_DIRECTORY;
+    DIR *d;
+    struct dirent *dir;
+    bool found = false;
+
+    d = opendir(location);
+    if (d == NULL)
+        return NULL;
+    while ((dir = readdir(d)) != NULL)
+    {
+        if (strcmp(dir->d_name, version_dir) == 0)
+            found = true;
+        else if (strncmp(dir->d_name, "PG_", 3) == 0 && verbose)
+            printf("DEBUG: skipping %s/%s, it is not the directory %s of "
+                "this cluster\n", location, dir->d_name, version_dir);
+    }
+    closedir(d);
+
+    if (!found)
+    {
+        if (verbose)
+            printf("DEBUG: %s has no directory %s\n", location, version_dir);
+        return NULL;
+    }
+
+    return psprintf("%s/%s", location, version_dir);
+}
+
+static uint64
+scan_tablespace(const char *location)
+{
+    char *path = tablespace_version_path(location);
+    uint64 corrupt_pages_found = 0;
+
+    if (path != NULL)
+        corrupt_pages_found = scan_directory(path);
+    free(path);
+
+    return corrupt_pages_found;
+}
+
+static uint64
+scan_tablespaces(const char *tblspcdir,
+    uint64 (*scan_location)(const char *location))
+{
+    /* Every entry of pg_tblspc is a symbolic link to the location of a
+     * tablespace, or with allow_in_place_tablespaces a directory, that holds
+     * a version directory such as PG_15_202209061 with one directory per
+     * database, see tablespace_version_path().  The links are followed, and
+     * a location that two entries resolve to is only scanned once.
+     */
+    DIR *d;
+    struct dirent *dir;
+    struct stat statbuf;
+    char *path = NULL;
+    dev_t *seen_dev = NULL;
+    ino_t *seen_ino = NULL;
+    size_t nseen = 0;
+    size_t i;
+    uint64 corrupt_pages_found = 0;
+
+    d = opendir(tblspcdir);
+    if (d == NULL)
+        return 0;
+
+    while ((dir = readdir(d)) != NULL)
+    {
+        if (strcmp(".", dir->d_name) == 0 || strcmp("..", dir->d_name) == 0)
+            continue;
+
+        free(path);
+        path = psprintf("%s/%s", tblspcdir, dir->d_name);
+        if (stat(path, &statbuf) < 0)
+        {
+            fprintf(stderr, "ERROR: %s: tablespace %s cannot be opened\n",
+                strerror(errno), path);
+            corrupt_pages_found++;
+            continue;
+        }
+        if (!S_ISDIR(statbuf.st_mode))
+            continue;
+
+        for (i = 0; i < nseen; i++)
+            if (seen_dev[i] == statbuf.st_dev && seen_ino[i] == statbuf.st_ino)
+                break;
+        if (i < nseen)
+            continue;
+
+        seen_dev = realloc(seen_dev, (nseen + 1) * sizeof(dev_t));
+        seen_ino = realloc(seen_ino, (nseen + 1) * sizeof(ino_t));
+        if (seen_dev == NULL || seen_ino == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory scanning %s\n", tblspcdir);
+            exit(1);
+        }
+        seen_dev[nseen] = statbuf.st_dev;
+        seen_ino[nseen] = statbuf.st_ino;
+        nseen++;
+
+        corrupt_pages_found += scan_location(path);
+    }
+    closedir(d);
+    free(path);
+    free(seen_dev);
+    free(seen_ino);
+
+    return corrupt_pages_found;
+}
+
+static uint64
+scan_data_directory(const char *datadir)
+{
+    /* The relation files of a cluster live in global for shared catalogs,
+     * base for the default tablespace and pg_tblspc for all others.  The
+     * other directories, such as pg_wal, contain unsupported file types.
+     */
+    char *path;
+    uint64 corrupt_pages_found = 0;
+
+    path = psprintf("%s/global", datadir);
+    corrupt_pages_found += scan_directory(path);
+    free(path);
+    path = psprintf("%s/base", datadir);
+    corrupt_pages_found += scan_directory(path);
+    free(path);
+    path = psprintf("%s/pg_tblspc", datadir);
+    corrupt_pages_found += scan_tablespaces(path, scan_tablespace);
+    free(path);
+
+    return corrupt_pages_found;
+}
+
+static bool
+is_relation_url(const char *dirpath, const char *filename)
+{
+    /* Relation files in a copy of a data directory are in global or in a
+     * database directory named by its OID, under base or a tablespace.
+     * Other directories, such as pg_wal, hold files with names of digits
+     * too.
+     */
+    const char *parent = strrchr(dirpath, '/');
+
+    parent = parent != NULL ? parent + 1 : dirpath;
+    if (strcmp(parent, "global") != 0 &&
+        (*parent == '\0' || strspn(parent, "0123456789") != strlen(parent)))
+        return false;
+
+    return is_relation_file(filename);
+}
+
+static uint64
+scan_url_list(const char *listfile)
+{
+    /* One URL of a segment file per line, optionally followed by its size
+     * in bytes as listed by the object store; without it the size is asked
+     * for when the file is split between workers.  Files are reported by
+     * their URL up to the query string.
+     */
+    FILE *fp = strcmp(listfile, "-") == 0 ? stdin : fopen(listfile, "r");
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    char *url;
+    char *dirpath;
+    char *filename;
+    char *lastdir = NULL;
+    const char *error;
+    long long size;
+    size_t pathlen;
+    DatabaseStats *db = NULL;
+    uint64 corrupt_pages_found = 0;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "ERROR: %s: --url-list %s cannot be read\n",
+            strerror(errno), listfile);
+        exit(1);
+    }
+    while (!scan_stopped() && (len = getline(&line, &linesize, fp)) >= 0)
+    {
+        url = line + strspn(line, " \t");
+        if (*url == '\0' || *url == '\n' || *url == '#')
+            continue;
+        size = -1;
+        url[strcspn(url, " \t\r\n")] = '\0';
+        if (url + strlen(url) < line + len - 1)
+            sscanf(url + strlen(url) + 1, "%lld", &size);
+
+        pathlen = strcspn(url, "?#");
+        dirpath = psprintf("%.*s", (int) pathlen, url);
+        filename = strrchr(dirpath, '/');
+        if (strncmp(url, "http://", 7) != 0 || filename < dirpath + 7)
+        {
+            fprintf(stderr, "ERROR: %.*s is not an http:// URL of a file\n",
+                (int) pathlen, url);
+            corrupt_pages_found++;
+            free(dirpath);
+            continue;
+        }
+        *filename++ = '\0';
+        if (!is_relation_url(dirpath, filename))
+        {
+            if (verbose)
+                printf("DEBUG: skipping %s/%s, not a checksummed relation "
+                    "fork\n", dirpath, filename);
+            free(dirpath);
+            continue;
+        }
+
+        __sync_fetch_and_add(&scan_stats.files, 1);
+        if (show_stats && (lastdir == NULL || strcmp(lastdir, dirpath) != 0))
+            db = new_database_stats(dirpath);
+        free(lastdir);
+        lastdir = psprintf("%s", dirpath);
+
+        if (num_workers > 1 && size < 0)
+        {
+            size = http_object_size(url, &error);
+            if (size < 0)
+            {
+                fprintf(stderr, "ERROR: %s: %s/%s cannot be read\n", error,
+                    dirpath, filename);
+                corrupt_pages_found++;
+                free(dirpath);
+                continue;
+            }
+        }
+
+        if (num_workers > 1)
+            queue_segmentfile(filename, dirpath, url, size, NULL, db);
+        else
+            corrupt_pages_found += scan_segment_range(filename, dirpath, url,
+                0, InvalidBlockNumber, NULL, db, &scan_io);
+        free(dirpath);
+    }
+    if (ferror(fp))
+    {
+        fprintf(stderr, "ERROR: %s: --url-list %s cannot be read\n",
+            strerror(errno), listfile);
+        exit(1);
+    }
+    if (fp != stdin)
+        fclose(fp);
+    free(line);
+    free(lastdir);
+
+    return corrupt_pages_found;
+}
+
+static void
+set_pass_rate(uint64 remaining, time_t pass_end, double limit)
+{
+    /* With --pass-days the rest of the pass is spread evenly over the time
+     * left, --max-rate caps that and is used alone once the pass is late.
+     */
+    double seconds = difftime(pass_end, time(NULL));
+    double rate;
+
+    max_rate = limit;
+    if (pass_days <= 0 || remaining == 0)
+        return;
+    rate = seconds > 0 ? remaining / seconds / (1024 * 1024) : 0;
+    if (rate > 0 && (limit == 0 || rate < limit))
+        max_rate = rate;
+}
+
+static void
+publish_pass(uint64 total, uint64 remaining)
+{
+    /* progress of the pass for --metrics */
+    pthread_mutex_lock(&metrics_lock);
+    metrics.pass_number = pass.number;
+    metrics.pass_start = pass.start;
+    metrics.pass_bytes = total;
+    metrics.pass_remaining = remaining;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void
+run_daemon(const char *datadir)
+{
+    /* Runs passes until SIGTERM or SIGINT, which stop it at the end of the
+     * step in progress with the cursor saved.  A pass that ends before the
+     * next one is due, after --pass-days, waits for it.
+     */
+    double limit = max_rate;
+    uint64 corrupted;
+    uint64 total, remaining;
+    BlockNumber blkno, startblk, nblocks;
+    time_t pass_end, last_save;
+    PassFile *file;
+    bool last;
+    size_t i;
+
+    load_cursor();
+    if (pass.number == 0)
+    {
+        pass.number = 1;
+        pass.start = time(NULL);
+    }
+    signal(SIGTERM, daemon_signal_handler);
+    signal(SIGINT, daemon_signal_handler);
+
+    while (!daemon_stop)
+    {
+        publish_pass(0, 0);
+        while (!daemon_stop && time(NULL) < pass.start)
+            sleep(1);
+        if (daemon_stop)
+            break;
+
+        /* errors opening tablespaces count like those of a one shot scan */
+        corrupted = scan_data_directory(datadir);
+        qsort(pass.files, pass.nfiles, sizeof(PassFile), compare_pass_files);
+
+        /* Skip what the pass verified before a restart.  A file modified
+         * since may move and be verified twice or only in the next pass.
+         */
+        startblk = 0;
+        for (i = 0; pass.resume_path != NULL && i < pass.nfiles; i++)
+        {
+            file = &pass.files[i];
+            if (compare_pass_order(file->relpath, file->mtime,
+                    pass.resume_path, pass.resume_mtime) >= 0)
+            {
+                if (strcmp(file->relpath, pass.resume_path) == 0)
+                    startblk = pass.resume_block;
+                break;
+            }
+        }
+
+        total = remaining = 0;
+        for (file = pass.files; file < pass.files + pass.nfiles; file++)
+        {
+            total += file->size;
+            if (file >= pass.files + i)
+                remaining += file->size;
+        }
+        if (remaining > (uint64) startblk * page_size)
+            remaining -= (uint64) startblk * page_size;
+        else
+            remaining = 0;
+        pass_end = pass.start + (time_t) (pass_days * 86400);
+        publish_pass(total, remaining);
+
+        printf("PASS %llu: verifying %zu of %zu segment files, %.1f MB\n",
+            (unsigned long long) pass.number, pass.nfiles - i, pass.nfiles,
+            remaining / (1024.0 * 1024.0));
+        fflush(stdout);
+
+        last_save = time(NULL);
+        for (; i < pass.nfiles && !daemon_stop; i++, startblk = 0)
+        {
+            file = &pass.files[i];
+            nblocks = file->size / page_size;
+            set_pass_rate(remaining, pass_end, limit);
+
+            /* the last step is open ended to verify pages appended since */
+            for (blkno = startblk; !daemon_stop; blkno += DAEMON_STEP_BLOCKS)
+            {
+                last = nblocks <= DAEMON_STEP_BLOCKS ||
+                    blkno >= nblocks - DAEMON_STEP_BLOCKS;
+                corrupted += scan_segment_range(file->filename,
+                    file->dirpath, NULL, blkno,
+                    last ? InvalidBlockNumber : blkno + DAEMON_STEP_BLOCKS,
+                    NULL, NULL, &scan_io);
+                remaining -= remaining < (uint64) DAEMON_STEP_BLOCKS *
+                    page_size ? remaining : (uint64) DAEMON_STEP_BLOCKS *
+                    page_size;
+                publish_pass(total, remaining);
+
+                if (!last)
+                    set_pass_cursor(file, blkno + DAEMON_STEP_BLOCKS);
+                else if (i + 1 < pass.nfiles)
+                    set_pass_cursor(&pass.files[i + 1], 0);
+                else
+                    set_pass_cursor(NULL, 0);
+                if (time(NULL) - last_save >= DAEMON_SAVE_SEC)
+                {
+                    save_cursor();
+                    last_save = time(NULL);
+                }
+                if (last)
+                    break;
+            }
+        }
+
+        for (file = pass.files; file < pass.files + pass.nfiles; file++)
+        {
+            free(file->dirpath);
+            free(file->relpath);
+        }
+        pass.nfiles = 0;
+        if (daemon_stop)
+            break;
+
+        if (corrupted > 0)
+            printf("PASS %llu: CORRUPTION FOUND: %llu\n",
+                (unsigned long long) pass.number,
+                (unsigned long long) corrupted);
+        else
+            printf("PASS %llu: NO CORRUPTION FOUND\n",
+                (unsigned long long) pass.number);
+        fflush(stdout);
+
+        pthread_mutex_lock(&metrics_lock);
+        metrics.pass_end = time(NULL);
+        pthread_mutex_unlock(&metrics_lock);
+
+        pass.number++;
+        pass.previous_start = pass.start;
+        pass.start = pass_days > 0 && pass_end > time(NULL) ?
+            pass_end : time(NULL);
+        set_pass_cursor(NULL, 0);
+        save_cursor();
+    }
+
+    save_cursor();
+    if (verbose)
+        printf("DEBUG: stopped pass %llu at %s block %u\n",
+            (unsigned long long) pass.number,
+            pass.resume_path != NULL ? pass.resume_path : "its start",
+            pass.resume_block);
+    free(pass.files);
+    free(pass.resume_path);
+}
+
+static void
+print_histogram(FILE *fp, const char *name, const char *help,
+    const uint64 *hist, uint64 sum_ns)
+{
+    uint64 count = 0;
+    int i;
+
+    fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+    {
+        count += hist[i];
+        fprintf(fp, "%s_bucket{le=\"%.6f\"} %llu\n", name, (1 << i) / 1e6,
+            (unsigned long long) count);
+    }
+    count += hist[LATENCY_BUCKETS - 1];
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+        (unsigned long long) count);
+    fprintf(fp, "%s_sum %.9f\n%s_count %llu\n", name, sum_ns / 1e9, name,
+        (unsigned long long) count);
+}
+
+static void
+write_metrics(void)
+{
+    /* Called with metrics_lock held.  The file is in the Prometheus text
+     * format for the textfile collector of node_exporter, renamed into
+     * place so that it is never read half written.
+     */
+    ScanStats totals = scan_stats.totals;
+    ScanStats *workers;
+    ScanIO *io;
+    int nworkers;
+    int i;
+    char *tmpname;
+    FILE *fp;
+    double days, lag;
+
+    for (io = metrics.ios; io != NULL; io = io->next_io)
+        add_scan_stats(&totals, &io->stats);
+
+    tmpname = psprintf("%s.tmp", metrics_file);
+    fp = fopen(tmpname, "w");
+    if (fp == NULL)
+    {
+        if (!metrics.warned)
+            fprintf(stderr, "WARNING: %s: metrics %s cannot be written\n",
+                strerror(errno), tmpname);
+        metrics.warned = true;
+        free(tmpname);
+        return;
+    }
+
+    fprintf(fp, "# HELP pg_page_verification_start_time_seconds Start of the "
+        "run.\n# TYPE pg_page_verification_start_time_seconds gauge\n"
+        "pg_page_verification_start_time_seconds %lld\n",
+        (long long) metrics.started);
+    fprintf(fp, "# HELP pg_page_verification_pages_verified_total Pages "
+        "verified.\n# TYPE pg_page_verification_pages_verified_total "
+        "counter\npg_page_verification_pages_verified_total %llu\n",
+        (unsigned long long) totals.pages);
+    fprintf(fp, "# HELP pg_page_verification_read_bytes_total Bytes read.\n"
+        "# TYPE pg_page_verification_read_bytes_total counter\n"
+        "pg_page_verification_read_bytes_total %llu\n",
+        (unsigned long long) totals.bytes_read);
+    fprintf(fp, "# HELP pg_page_verification_files_verified_total Segment "
+        "files verified.\n# TYPE pg_page_verification_files_verified_total "
+        "counter\npg_page_verification_files_verified_total %llu\n",
+        (unsigned long long) totals.files);
+    fprintf(fp, "# HELP pg_page_verification_corrupt_pages_total Pages with "
+        "an invalid checksum.\n"
+        "# TYPE pg_page_verification_corrupt_pages_total counter\n"
+        "pg_page_verification_corrupt_pages_total %llu\n",
+        (unsigned long long) totals.corrupt_pages);
+    if (check_headers)
+        fprintf(fp, "# HELP pg_page_verification_invalid_header_pages_total "
+            "Pages with a valid checksum but an invalid header.\n"
+            "# TYPE pg_page_verification_invalid_header_pages_total counter\n"
+            "pg_page_verification_invalid_header_pages_total %llu\n"
+            "# HELP pg_page_verification_new_pages_total All zero pages.\n"
+            "# TYPE pg_page_verification_new_pages_total counter\n"
+            "pg_page_verification_new_pages_total %llu\n",
+            (unsigned long long) totals.bad_headers,
+            (unsigned long long) totals.new_pages);
+    if (recheck_delay > 0)
+        fprintf(fp, "# HELP pg_page_verification_torn_pages_total Pages "
+            "that failed while being written and verified when read again.\n"
+            "# TYPE pg_page_verification_torn_pages_total counter\n"
+            "pg_page_verification_torn_pages_total %llu\n",
+            (unsigned long long) totals.torn_pages);
+
+    /* every worker that has scanned, whether its ScanIO is still in use */
+    nworkers = metrics.nworkers;
+    for (io = metrics.ios; io != NULL; io = io->next_io)
+        if (io->worker >= nworkers)
+            nworkers = io->worker + 1;
+    workers = calloc(nworkers + 1, sizeof(ScanStats));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < metrics.nworkers; i++)
+        workers[i] = metrics.workers[i];
+    for (io = metrics.ios; io != NULL; io = io->next_io)
+        add_scan_stats(&workers[io->worker], &io->stats);
+
+    fprintf(fp, "# HELP pg_page_verification_worker_pages_verified_total "
+        "Pages verified by each scanning thread.\n"
+        "# TYPE pg_page_verification_worker_pages_verified_total counter\n");
+    for (i = 0; i < nworkers; i++)
+        fprintf(fp, "pg_page_verification_worker_pages_verified_total"
+            "{worker=\"%d\"} %llu\n", i,
+            (unsigned long long) workers[i].pages);
+    fprintf(fp, "# HELP pg_page_verification_worker_read_bytes_total "
+        "Bytes read by each scanning thread.\n"
+        "# TYPE pg_page_verification_worker_read_bytes_total counter\n");
+    for (i = 0; i < nworkers; i++)
+        fprintf(fp, "pg_page_verification_worker_read_bytes_total"
+            "{worker=\"%d\"} %llu\n", i,
+            (unsigned long long) workers[i].bytes_read);
+    free(workers);
+
+    print_histogram(fp, "pg_page_verification_read_seconds",
+        "Time waiting for each read.", totals.read_hist, totals.read_ns);
+    print_histogram(fp, "pg_page_verification_checksum_seconds",
+        "Time checksumming each batch of pages.", totals.checksum_hist,
+        totals.checksum_ns);
+
+    if (metrics.pass_number > 0)
+    {
+        fprintf(fp, "# HELP pg_page_verification_pass Number of the daemon "
+            "pass.\n# TYPE pg_page_verification_pass gauge\n"
+            "pg_page_verification_pass %llu\n",
+            (unsigned long long) metrics.pass_number);
+        fprintf(fp, "# HELP pg_page_verification_pass_start_time_seconds "
+            "When the daemon pass started or is due.\n"
+            "# TYPE pg_page_verification_pass_start_time_seconds gauge\n"
+            "pg_page_verification_pass_start_time_seconds %lld\n",
+            (long long) metrics.pass_start);
+        fprintf(fp, "# HELP pg_page_verification_pass_remaining_bytes Bytes "
+            "left to verify in the daemon pass.\n"
+            "# TYPE pg_page_verification_pass_remaining_bytes gauge\n"
+            "pg_page_verification_pass_remaining_bytes %llu\n",
+            (unsigned long long) metrics.pass_remaining);
+        if (metrics.pass_end > 0)
+            fprintf(fp, "# HELP pg_page_verification_last_pass_end_time_"
+                "seconds When the last daemon pass ended.\n"
+                "# TYPE pg_page_verification_last_pass_end_time_seconds "
+                "gauge\npg_page_verification_last_pass_end_time_seconds "
+                "%lld\n", (long long) metrics.pass_end);
+    }
+    if (metrics.pass_number > 0 && pass_days > 0)
+    {
+        /* how far the pass is behind the even pace of --pass-days */
+        days = pass_days * 86400;
+        lag = difftime(time(NULL), metrics.pass_start);
+        if (lag < 0)
+            lag = 0;
+        else if (metrics.pass_bytes > 0)
+            lag -= days * (1 - (double) metrics.pass_remaining /
+                metrics.pass_bytes);
+        if (lag < 1)
+            lag = 0;
+        fprintf(fp, "# HELP pg_page_verification_pass_lag_seconds How far the "
+            "daemon pass is behind its --pass-days schedule.\n"
+            "# TYPE pg_page_verification_pass_lag_seconds gauge\n"
+            "pg_page_verification_pass_lag_seconds %.0f\n", lag);
+    }
+
+    if (fclose(fp) != 0 || rename(tmpname, metrics_file) != 0)
+    {
+        if (!metrics.warned)
+            fprintf(stderr, "WARNING: %s: metrics %s cannot be written\n",
+                strerror(errno), metrics_file);
+        metrics.warned = true;
+    }
+    free(tmpname);
+}
+
+static void *
+metrics_main(void *arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&metrics_lock);
+    while (!metrics.done)
+    {
+        write_metrics();
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += METRICS_INTERVAL_SEC;
+        while (!metrics.done &&
+            pthread_cond_timedwait(&metrics_wakeup, &metrics_lock,
+                &deadline) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    return NULL;
+}
+
+static void
+start_metrics_writer(void)
+{
+    metrics.started = time(NULL);
+    if (pthread_create(&metrics.thread, NULL, metrics_main, NULL) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot start the metrics writer\n");
+        exit(1);
+    }
+}
+
+static void
+finish_metrics_writer(void)
+{
+    /* the last write has the totals of every thread */
+    pthread_mutex_lock(&metrics_lock);
+    metrics.done = true;
+    pthread_cond_signal(&metrics_wakeup);
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_join(metrics.thread, NULL);
+
+    pthread_mutex_lock(&metrics_lock);
+    write_metrics();
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/* segment files or databases matched by scan_targets() */
+static int targets_found = 0;
+
+static uint64
+scan_relation(const char *dbdir)
+{
+    /* Verifies the main fork of --relfilenode in dbdir.  Segment N holds
+     * blocks [N * segment_blocks, (N + 1) * segment_blocks) of the relation,
+     * so only the segment files overlapping --segment and --blocks are
+     * opened and each is read from the first block asked for.
+     */
+    BlockNumber segno, lastseg, segstart, startblk, endblk, nblocks;
+    char filename[32];
+    char *path = NULL;
+    struct stat statbuf;
+    DatabaseStats *db = NULL;
+    uint64 corrupt_pages_found = 0;
+
+    if (target_segment >= 0)
+        segno = lastseg = target_segment;
+    else
+    {
+        segno = target_startblk / segment_blocks;
+        lastseg = target_endblk == InvalidBlockNumber ?
+            InvalidBlockNumber : (target_endblk - 1) / segment_blocks;
+    }
+
+    /* the relation ends at the first segment file that does not exist */
+    for (; segno <= lastseg; segno++)
+    {
+        if (segno == 0)
+            snprintf(filename, sizeof(filename), "%u", target_relfilenode);
+        else
+            snprintf(filename, sizeof(filename), "%u.%u", target_relfilenode,
+                segno);
+        free(path);
+        path = psprintf("%s/%s", dbdir, filename);
+        if (stat(path, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+            break;
+
+        segstart = segno * segment_blocks;
+        startblk = target_startblk > segstart ? target_startblk - segstart : 0;
+        if (target_endblk == InvalidBlockNumber ||
+            target_endblk - segstart >= segment_blocks)
+            endblk = InvalidBlockNumber;
+        else
+            endblk = target_endblk - segstart;
+
+        targets_found++;
+        scan_stats.files++;
+        if (show_stats && db == NULL)
+            db = new_database_stats(dbdir);
+
+        /* the blocks of the file in [startblk, endblk), to plan the scan */
+        nblocks = statbuf.st_size / page_size;
+        if (endblk < nblocks)
+            nblocks = endblk;
+        nblocks = nblocks > startblk ? nblocks - startblk : 0;
+
+        if (num_workers > 1)
+            queue_segment_range(filename, dbdir, NULL, startblk, endblk,
+                nblocks, NULL, db);
+        else
+            corrupt_pages_found += scan_segment_range(filename, dbdir,
+                NULL, startblk, endblk, NULL, db, &scan_io);
+    }
+    free(path);
+
+    return corrupt_pages_found;
+}
+
+static uint64
+scan_target_database(const char *dbdir)
+{
+    struct stat statbuf;
+
+    if (stat(dbdir, &statbuf) < 0 || !S_ISDIR(statbuf.st_mode))
+        return 0;
+
+    if (target_relfilenode != InvalidOid)
+        return scan_relation(dbdir);
+
+    targets_found++;
+    return scan_directory(dbdir);
+}
+
+static uint64
+scan_target_databases(const char *parent)
+{
+    /* parent is base or the version directory of a tablespace, with one
+     * directory per database named after its OID
+     */
+    DIR *d;
+    struct dirent *dir;
+    char *path;
+    uint64 corrupt_pages_found = 0;
+
+    if (target_database_set)
+    {
+        path = psprintf("%s/%u", parent, target_database);
+        corrupt_pages_found = scan_target_database(path);
+        free(path);
+        return corrupt_pages_found;
+    }
+
+    d = opendir(parent);
+    if (d == NULL)
+        return 0;
+    while ((dir = readdir(d)) != NULL)
+    {
+        if (strspn(dir->d_name, "0123456789") != strlen(dir->d_name) ||
+            dir->d_name[0] == '\0')
+            continue;
+        path = psprintf("%s/%s", parent, dir->d_name);
+        corrupt_pages_found += scan_target_database(path);
+        free(path);
+    }
+    closedir(d);
+
+    return corrupt_pages_found;
+}
+
+static uint64
+scan_target_tablespace(const char *location)
+{
+    /* only the version directory of this cluster is looked at, the same
+     * relfilenode in that of another cluster is a different relation
+     */
+    char *path = tablespace_version_path(location);
+    uint64 corrupt_pages_found = 0;
+
+    if (path != NULL)
+        corrupt_pages_found = scan_target_databases(path);
+    free(path);
+
+    return corrupt_pages_found;
+}
+
+static uint64
+scan_targets(const char *datadir)
+{
+    /* Goes straight to the database directories of --database-oid, 0 being
+     * the shared catalogs in global, or to every database directory when
+     * only --relfilenode is given, without listing their contents.  A
+     * target that cannot be found is reported like a file that cannot be
+     * opened.
+     */
+    char *path;
+    uint64 corrupt_pages_found = 0;
+
+    if (!target_database_set || target_database == InvalidOid)
+    {
+        path = psprintf("%s/global", datadir);
+        if (target_relfilenode != InvalidOid)
+            corrupt_pages_found += scan_relation(path);
+        else
+            corrupt_pages_found += scan_target_database(path);
+        free(path);
+    }
+    if (!target_database_set || target_database != InvalidOid)
+    {
+        path = psprintf("%s/base", datadir);
+        corrupt_pages_found += scan_target_databases(path);
+        free(path);
+        path = psprintf("%s/pg_tblspc", datadir);
+        corrupt_pages_found += scan_tablespaces(path, scan_target_tablespace);
+        free(path);
+    }
+
+    if (targets_found == 0)
+    {
+        if (target_relfilenode == InvalidOid)
+            fprintf(stderr, "ERROR: database %u not found\n", target_database);
+        else if (target_segment >= 0 || target_startblk > 0)
+            fprintf(stderr, "ERROR: relation %u has no segment file holding "
+                "the blocks asked for\n", target_relfilenode);
+        else
+            fprintf(stderr, "ERROR: relation %u not found\n",
+                target_relfilenode);
+        corrupt_pages_found++;
+    }
+
+    return corrupt_pages_found;
+}
+
+/* A tar archive read front to back.  Members are only ever read in order,
+ * so the archive can be a pipe; skipped members are seeked over when the
+ * archive is a regular file.
+ */
+#define TAR_BLOCK 512
+
+/* Compressed archives, and archives read from a pipe, are read and
+ * decompressed by a thread of their own that fills the TAR_PIPE_SLOTS
+ * chunks of a ring while the scanning thread parses and verifies the ones
+ * filled before.  The ring has a single producer and a single consumer that
+ * only publish the head and tail with atomic stores; the lock and
+ * condition variable are only used to sleep on a full or empty ring.
+ */
+#define TAR_PIPE_SLOTS 8
+#define TAR_PIPE_INPUT (256 * 1024)
+
+typedef enum
+{
+    TAR_PLAIN,
+    TAR_GZIP,
+    TAR_ZSTD,
+    TAR_LZ4
+} TarCompression;
+
+typedef struct TarPipe
+{
+    int             fd;
+    const char     *name;
+    char           *slots[TAR_PIPE_SLOTS];
+    size_t          lengths[TAR_PIPE_SLOTS];
+    size_t          slot_size;
+    unsigned long   head;       /* chunks consumed */
+    unsigned long   tail;       /* chunks filled */
+    int             done;       /* no chunk follows the ones filled */
+    int             failed;
+    int             stop;       /* the consumer is done with the archive */
+    int             producer_waiting;
+    int             consumer_waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;
+    pthread_t       thread;
+    size_t          pos;        /* consumer position in the head chunk */
+
+    /* producer side */
+    TarCompression  compression;
+    char           *input;
+    size_t          in_len;
+    size_t          in_pos;
+    bool            in_eof;
+    bool            out_full;   /* a decoder may hold back more output */
+    bool            frame_end;  /* not in the middle of a compressed frame */
+#ifdef USE_ZLIB
+    z_stream        zlib;
+#endif
+#ifdef USE_ZSTD
+    ZSTD_DStream   *zstd;
+#endif
+#ifdef USE_LZ4
+    LZ4F_dctx      *lz4;
+#endif
+} TarPipe;
+
+typedef struct TarStream
+{
+    int         fd;
+    const char *name;
+    bool        seekable;
+    bool        failed;     /* the rest of the archive cannot be read */
+    TarPipe    *pipe;
+} TarStream;
+
+static TarCompression
+tar_compression(const unsigned char *magic, size_t len)
+{
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return TAR_GZIP;
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+        magic[2] == 0x2f && magic[3] == 0xfd)
+        return TAR_ZSTD;
+    if (len >= 4 && magic[0] == 0x04 && magic[1] == 0x22 &&
+        magic[2] == 0x4d && magic[3] == 0x18)
+        return TAR_LZ4;
+
+    return TAR_PLAIN;
+}
+
+static void
+tar_pipe_wake(TarPipe *pipe, int *waiting)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&pipe->lock);
+        pthread_cond_broadcast(&pipe->wakeup);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+}
+
+static bool
+tar_pipe_refill(TarPipe *pipe)
+{
+    ssize_t nread;
+
+    do
+        nread = read(pipe->fd, pipe->input, TAR_PIPE_INPUT);
+    while (nread < 0 && errno == EINTR);
+    if (nread < 0)
+    {
+        fprintf(stderr, "ERROR: %s: %s cannot be read\n", strerror(errno),
+            pipe->name);
+        return false;
+    }
+    pipe->in_len = nread;
+    pipe->in_pos = 0;
+    pipe->in_eof = nread == 0;
+
+    return true;
+}
+
+static bool
+tar_pipe_decoder_start(TarPipe *pipe)
+{
+    /* picks the decoder from the magic bytes of the first input */
+    const char *missing = NULL;
+
+    pipe->compression = tar_compression((unsigned char *) pipe->input,
+        pipe->in_len);
+    pipe->frame_end = true;
+
+    switch (pipe->compression)
+    {
+        case TAR_PLAIN:
+            break;
+
+        case TAR_GZIP:
+#ifdef USE_ZLIB
+            memset(&pipe->zlib, 0, sizeof(pipe->zlib));
+            /* 32 has zlib detect and check the gzip header */
+            if (inflateInit2(&pipe->zlib, 15 + 32) != Z_OK)
+            {
+                fprintf(stderr, "ERROR: cannot start gzip decompression\n");
+                return false;
+            }
+#else
+            missing = "gzip, rebuild with make USE_ZLIB=1";
+#endif
+            break;
+
+        case TAR_ZSTD:
+#ifdef USE_ZSTD
+            pipe->zstd = ZSTD_createDStream();
+            if (pipe->zstd == NULL)
+            {
+                fprintf(stderr, "ERROR: cannot start zstd decompression\n");
+                return false;
+            }
+            ZSTD_initDStream(pipe->zstd);
+#else
+            missing = "zstd, rebuild with make USE_ZSTD=1";
+#endif
+            break;
+
+        case TAR_LZ4:
+#ifdef USE_LZ4
+            if (LZ4F_isError(LZ4F_createDecompressionContext(&pipe->lz4,
+                LZ4F_VERSION)))
+            {
+                fprintf(stderr, "ERROR: cannot start lz4 decompression\n");
+                return false;
+            }
+#else
+            missing = "lz4, rebuild with make USE_LZ4=1";
+#endif
+            break;
+    }
+
+    if (missing != NULL)
+    {
+        fprintf(stderr, "ERROR: %s is compressed with %s\n", pipe->name,
+            missing);
+        return false;
+    }
+
+    return true;
+}
+
+static void
+tar_pipe_decoder_end(TarPipe *pipe)
+{
+    switch (pipe->compression)
+    {
+        case TAR_PLAIN:
+            break;
+        case TAR_GZIP:
+#ifdef USE_ZLIB
+            inflateEnd(&pipe->zlib);
+#endif
+            break;
+        case TAR_ZSTD:
+#ifdef USE_ZSTD
+            ZSTD_freeDStream(pipe->zstd);
+#endif
+            break;
+        case TAR_LZ4:
+#ifdef USE_LZ4
+            LZ4F_freeDecompressionContext(pipe->lz4);
+#endif
+            break;
+    }
+}
+
+static size_t
+tar_pipe_decode(TarPipe *pipe, char *out, size_t len)
+{
+    /* Fills out with up to len bytes of the archive, less only at its end
+     * or when the input cannot be read or decompressed, which sets failed.
+     * What was decompressed before an error is still returned so that it
+     * can be verified.
+     */
+    size_t done = 0;
+    size_t n;
+
+    while (done < len)
+    {
+        if (pipe->in_pos == pipe->in_len && !pipe->out_full)
+        {
+            if (!tar_pipe_refill(pipe))
+            {
+                pipe->failed = 1;
+                return done;
+            }
+            if (pipe->in_eof)
+                break;
+        }
+
+        switch (pipe->compression)
+        {
+            case TAR_PLAIN:
+                n = pipe->in_len - pipe->in_pos;
+                if (n > len - done)
+                    n = len - done;
+                memcpy(out + done, pipe->input + pipe->in_pos, n);
+                pipe->in_pos += n;
+                done += n;
+                break;
+
+            case TAR_GZIP:
+#ifdef USE_ZLIB
+                {
+                    int ret;
+
+                    pipe->zlib.next_in = (Bytef *) pipe->input + pipe->in_pos;
+                    pipe->zlib.avail_in = pipe->in_len - pipe->in_pos;
+                    pipe->zlib.next_out = (Bytef *) out + done;
+                    pipe->zlib.avail_out = len - done;
+                    ret = inflate(&pipe->zlib, Z_NO_FLUSH);
+                    pipe->in_pos = pipe->in_len - pipe->zlib.avail_in;
+                    if (len - pipe->zlib.avail_out > done)
+                        pipe->frame_end = false;
+                    done = len - pipe->zlib.avail_out;
+                    if (ret == Z_STREAM_END)
+                    {
+                        /* gzip files can be concatenated */
+                        pipe->frame_end = true;
+                        inflateReset(&pipe->zlib);
+                    }
+                    else if (ret != Z_OK && ret != Z_BUF_ERROR)
+                    {
+                        fprintf(stderr, "ERROR: %s: %s cannot be "
+                            "decompressed\n", pipe->zlib.msg ?
+                            pipe->zlib.msg : "invalid data", pipe->name);
+                        pipe->failed = 1;
+                        return done;
+                    }
+                }
+#endif
+                break;
+
+            case TAR_ZSTD:
+#ifdef USE_ZSTD
+                {
+                    ZSTD_inBuffer in = { pipe->input, pipe->in_len,
+                        pipe->in_pos };
+                    ZSTD_outBuffer outbuf = { out, len, done };
+                    size_t ret = ZSTD_decompressStream(pipe->zstd, &outbuf, &in);
+
+                    if (ZSTD_isError(ret))
+                    {
+                        fprintf(stderr, "ERROR: %s: %s cannot be "
+                            "decompressed\n", ZSTD_getErrorName(ret),
+                            pipe->name);
+                        pipe->failed = 1;
+                        return done;
+                    }
+                    pipe->in_pos = in.pos;
+                    done = outbuf.pos;
+                    pipe->frame_end = ret == 0;
+                }
+#endif
+                break;
+
+            case TAR_LZ4:
+#ifdef USE_LZ4
+                {
+                    size_t dst = len - done;
+                    size_t src = pipe->in_len - pipe->in_pos;
+                    size_t ret = LZ4F_decompress(pipe->lz4, out + done, &dst,
+                        pipe->input + pipe->in_pos, &src, NULL);
+
+                    if (LZ4F_isError(ret))
+                    {
+                        fprintf(stderr, "ERROR: %s: %s cannot be "
+                            "decompressed\n", LZ4F_getErrorName(ret),
+                            pipe->name);
+                        pipe->failed = 1;
+                        return done;
+                    }
+                    pipe->in_pos += src;
+                    done += dst;
+                    pipe->frame_end = ret == 0;
+                }
+#endif
+                break;
+        }
+        pipe->out_full = done == len;
+    }
+
+    if (pipe->in_eof && !pipe->frame_end)
+    {
+        fprintf(stderr, "ERROR: %s ends in the middle of a compressed "
+            "frame\n", pipe->name);
+        pipe->failed = 1;
+    }
+
+    return done;
+}
+
+static void *
+tar_pipe_producer(void *arg)
+{
+    TarPipe *pipe = arg;
+    unsigned long tail = 0;
+    size_t filled;
+    char *slot;
+
+    if (!tar_pipe_refill(pipe) || !tar_pipe_decoder_start(pipe))
+        pipe->failed = 1;
+
+    while (!pipe->failed)
+    {
+        /* wait for the consumer to hand back a chunk */
+        if (tail - __atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST) ==
+            TAR_PIPE_SLOTS)
+        {
+            __atomic_store_n(&pipe->producer_waiting, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_lock(&pipe->lock);
+            while (tail - __atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST) ==
+                   TAR_PIPE_SLOTS &&
+                   !__atomic_load_n(&pipe->stop, __ATOMIC_SEQ_CST))
+                pthread_cond_wait(&pipe->wakeup, &pipe->lock);
+            pthread_mutex_unlock(&pipe->lock);
+            __atomic_store_n(&pipe->producer_waiting, 0, __ATOMIC_SEQ_CST);
+        }
+        if (__atomic_load_n(&pipe->stop, __ATOMIC_SEQ_CST))
+            break;
+
+        slot = pipe->slots[tail % TAR_PIPE_SLOTS];
+        filled = tar_pipe_decode(pipe, slot, pipe->slot_size);
+        if (filled > 0)
+        {
+            pipe->lengths[tail % TAR_PIPE_SLOTS] = filled;
+            __atomic_store_n(&pipe->tail, ++tail, __ATOMIC_SEQ_CST);
+            tar_pipe_wake(pipe, &pipe->consumer_waiting);
+        }
+        if (filled < pipe->slot_size)
+            break;
+    }
+
+    /* failed is only read by the consumer once done is seen */
+    __atomic_store_n(&pipe->done, 1, __ATOMIC_SEQ_CST);
+    tar_pipe_wake(pipe, &pipe->consumer_waiting);
+
+    return NULL;
+}
+
+static TarPipe *
+tar_pipe_start(int fd, const char *name)
+{
+    TarPipe *pipe = calloc(1, sizeof(TarPipe));
+    int i;
+
+    if (pipe == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory reading %s\n", name);
+        exit(1);
+    }
+    pipe->fd = fd;
+    pipe->name = name;
+    pipe->slot_size = read_buffer_size;
+    for (i = 0; i < TAR_PIPE_SLOTS; i++)
+        pipe->slots[i] = alloc_read_buffer(pipe->slot_size);
+    pipe->input = alloc_read_buffer(TAR_PIPE_INPUT);
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->wakeup, NULL);
+
+    if (pthread_create(&pipe->thread, NULL, tar_pipe_producer, pipe) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot start the thread reading %s\n", name);
+        exit(1);
+    }
+
+    return pipe;
+}
+
+static void
+tar_pipe_finish(TarPipe *pipe)
+{
+    /* the archive may end before its input does, let the producer go */
+    int i;
+
+    __atomic_store_n(&pipe->stop, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&pipe->lock);
+    pthread_cond_broadcast(&pipe->wakeup);
+    pthread_mutex_unlock(&pipe->lock);
+    pthread_join(pipe->thread, NULL);
+
+    tar_pipe_decoder_end(pipe);
+    for (i = 0; i < TAR_PIPE_SLOTS; i++)
+        free(pipe->slots[i]);
+    free(pipe->input);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->wakeup);
+    free(pipe);
+}
+
+static ssize_t
+tar_pipe_read(TarPipe *pipe, char *buffer, size_t len)
+{
+    unsigned long head = pipe->head;
+    size_t slot, n;
+    size_t done = 0;
+
+    while (done < len)
+    {
+        if (head == __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST))
+        {
+            /* done is published after the last chunk, look again */
+            if (__atomic_load_n(&pipe->done, __ATOMIC_SEQ_CST))
+            {
+                if (head != __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST))
+                    continue;
+                break;
+            }
+            __atomic_store_n(&pipe->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_lock(&pipe->lock);
+            while (head == __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST) &&
+                   !__atomic_load_n(&pipe->done, __ATOMIC_SEQ_CST))
+                pthread_cond_wait(&pipe->wakeup, &pipe->lock);
+            pthread_mutex_unlock(&pipe->lock);
+            __atomic_store_n(&pipe->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        slot = head % TAR_PIPE_SLOTS;
+        n = pipe->lengths[slot] - pipe->pos;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buffer + done, pipe->slots[slot] + pipe->pos, n);
+        pipe->pos += n;
+        done += n;
+
+        if (pipe->pos == pipe->lengths[slot])
+        {
+            pipe->pos = 0;
+            __atomic_store_n(&pipe->head, ++head, __ATOMIC_SEQ_CST);
+            tar_pipe_wake(pipe, &pipe->producer_waiting);
+        }
+    }
+
+    /* the producer has reported why the archive cannot be read */
+    if (done < len && __atomic_load_n(&pipe->failed, __ATOMIC_SEQ_CST))
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    return done;
+}
+
+static ssize_t
+tar_read(TarStream *tar, char *buffer, size_t len)
+{
+    /* like read_fully() for a stream, returns less than len only at the end
+     * of the archive
+     */
+    size_t done = 0;
+    ssize_t nread;
+
+    if (tar->pipe != NULL)
+        return tar_pipe_read(tar->pipe, buffer, len);
+
+    while (done < len)
+    {
+        nread = read(tar->fd, buffer + done, len - done);
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nread == 0)
+            break;
+        done += nread;
+    }
+
+    return done;
+}
+
+static bool
+tar_skip(TarStream *tar, ScanIO *io, uint64 len)
+{
+    size_t chunk;
+
+    if (tar->seekable && lseek(tar->fd, len, SEEK_CUR) >= 0)
+        return true;
+
+    while (len > 0)
+    {
+        chunk = len < read_buffer_size ? len : read_buffer_size;
+        if (tar_read(tar, io->buffer, chunk) != (ssize_t) chunk)
+            return false;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+static uint64
+tar_number(const char *field, size_t len)
+{
+    /* octal, or base-256 with the high bit set for GNU tar's large values */
+    uint64 value = 0;
+    size_t i;
+
+    if ((unsigned char) field[0] & 0x80)
+    {
+        value = (unsigned char) field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+
+    for (i = 0; i < len && (field[i] == ' ' || field[i] == '\0'); i++)
+        ;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + field[i] - '0';
+
+    return value;
+}
+
+static bool
+tar_header_valid(const char *header)
+{
+    /* the checksum is the sum of the header bytes with the checksum field
+     * itself taken as spaces
+     */
+    uint64 sum = 0;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) header[i];
+
+    return sum == tar_number(header + 148, 8);
+}
+
+static bool
+is_relation_path(const char *path)
+{
+    /* Members of base.tar are named global/<file> and base/<db>/<file>,
+     * those of a tablespace's archive PG_<version>/<db>/<file>.  The
+     * directory has to be checked as well, pg_xact and others hold files
+     * with numeric names too.
+     */
+    const char *filename = strrchr(path, '/');
+    const char *dbdir;
+    size_t dblen;
+
+    if (filename == NULL || !is_relation_file(filename + 1))
+        return false;
+    if (filename - path == 6 && strncmp(path, "global", 6) == 0)
+        return true;
+
+    for (dbdir = filename; dbdir > path && dbdir[-1] != '/'; dbdir--)
+        ;
+    dblen = filename - dbdir;
+    if (dblen == 0 || strspn(dbdir, "0123456789") < dblen)
+        return false;
+    if (dbdir - path == 5 && strncmp(path, "base/", 5) == 0)
+        return true;
+
+    return strncmp(path, "PG_", 3) == 0 && strchr(path, '/') + 1 == dbdir;
+}
+
+static uint64
+scan_tar_member(TarStream *tar, const char *path, uint64 size,
+    DatabaseStats **db, ScanIO *io)
+{
+    /* Verifies a relation member as it streams past, read_buffer_size bytes
+     * at a time.  The block numbers follow from the segment suffix of the
+     * member's name just like for a file on disk.
+     */
+    char *dirpath;
+    const char *filename = strrchr(path, '/') + 1;
+    ScanStats before = io->stats;
+    SegmentFile file;
+    BlockNumber blkno = 0;
+    uint64 corrupted = 0;
+    uint64 start = 0;
+    size_t chunk;
+    ssize_t nread;
+
+    dirpath = psprintf("%.*s", (int) (filename - path - 1), path);
+    if (show_stats && (*db == NULL || strcmp((*db)->path, dirpath) != 0))
+        *db = new_database_stats(dirpath);
+
+    file.filename = filename;
+    file.dirpath = dirpath;
+    file.url = NULL;
+    file.fd = -1;
+    file.segmentNumber = parse_segment_number(filename);
+    file.segmentBlockOffset = segment_blocks * file.segmentNumber;
+    file.record = NULL;
+    file.db = *db;
+    if (keep_records)
+    {
+        file.record = new_file_record(path);
+        file.record->size = size;
+        append_file_record(file.record);
+    }
+    io->digest = 0;
+
+    if (verbose)
+        printf("DEBUG: scanning tar member %s, %llu bytes\n", path,
+            (unsigned long long) size);
+
+    while (size > 0 && !scan_stopped())
+    {
+        chunk = size < read_buffer_size ? size : read_buffer_size;
+        if (measure_times)
+            start = stats_clock();
+        nread = tar_read(tar, io->buffer, chunk);
+        if (measure_times)
+            record_time(&io->stats.read_ns, io->stats.read_hist, start);
+        if (nread < 0)
+        {
+            fprintf(stderr, "ERROR: %s: %s cannot be read\n", strerror(errno),
+                tar->name);
+            tar->failed = true;
+            corrupted++;
+            break;
+        }
+
+        corrupted += verify_buffer(io->buffer, nread, blkno, &file, io);
+        blkno += nread / page_size;
+        size -= nread;
+
+        if ((size_t) nread < chunk)
+        {
+            fprintf(stderr, "ERROR: %s ends in the middle of %s\n", tar->name,
+                path);
+            tar->failed = true;
+            corrupted++;
+            break;
+        }
+    }
+
+    if (file.record != NULL)
+    {
+        file.record->digest = io->digest;
+        file.record->corrupted = corrupted;
+    }
+    if (!tar->failed)
+    {
+        STATS_ADD(io->stats.files, 1);
+        scan_stats.files++;
+    }
+    if (*db != NULL)
+        add_database_stats(*db, &before, &io->stats);
+    free(dirpath);
+
+    return corrupted;
+}
+
+static uint64
+scan_tar(const char *archive, ScanIO *io)
+{
+    /* Walks the ustar headers of the archive, including the pax and GNU
+     * long name records pg_basebackup and tar use for long paths, and
+     * verifies the members that are relation files.  Nothing is written to
+     * disk.
+     */
+    TarStream tar;
+    struct stat statbuf;
+    char header[TAR_BLOCK];
+    char *path = NULL;
+    char *longname = NULL;
+    DatabaseStats *db = NULL;
+    uint64 corrupted = 0;
+    uint64 size, padded;
+    const char *name;
+    ssize_t nread;
+    char type;
+
+    tar.name = strcmp(archive, "-") == 0 ? "stdin" : archive;
+    tar.fd = strcmp(archive, "-") == 0 ? STDIN_FILENO : open(archive, O_RDONLY);
+    if (tar.fd < 0)
+    {
+        fprintf(stderr, "ERROR: %s: %s cannot be opened\n", strerror(errno),
+            archive);
+        return 1;
+    }
+    tar.seekable = fstat(tar.fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+    if (tar.seekable)
+        posix_fadvise(tar.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* An uncompressed archive in a file is read in place so that members
+     * that are not verified can be seeked over, anything else goes through
+     * the reading thread.
+     */
+    tar.failed = false;
+    tar.pipe = NULL;
+    if (tar.seekable)
+    {
+        unsigned char magic[4];
+        ssize_t nmagic = pread(tar.fd, magic, sizeof(magic), 0);
+
+        if (nmagic > 0 && tar_compression(magic, nmagic) != TAR_PLAIN)
+            tar.seekable = false;
+    }
+    if (!tar.seekable)
+        tar.pipe = tar_pipe_start(tar.fd, tar.name);
+
+    while (!scan_stopped())
+    {
+        nread = tar_read(&tar, header, TAR_BLOCK);
+        if (nread < 0)
+        {
+            fprintf(stderr, "ERROR: %s: %s cannot be read\n", strerror(errno),
+                tar.name);
+            corrupted++;
+            break;
+        }
+        /* the archive ends with zero blocks, some writers leave them out */
+        if (nread == 0 || (nread == TAR_BLOCK && header[0] == '\0'))
+            break;
+        if (nread < TAR_BLOCK || !tar_header_valid(header))
+        {
+            fprintf(stderr, "ERROR: %s is not a tar archive or is damaged\n",
+                tar.name);
+            corrupted++;
+            break;
+        }
+
+        type = header[156];
+        size = tar_number(header + 124, 12);
+        padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+        if (type == 'L' || type == 'x')
+        {
+            /* the name of the next member, GNU style as the whole data, pax
+             * style as a "<len> path=<name>\n" record among others
+             */
+            char *record;
+
+            if (padded >= read_buffer_size ||
+                tar_read(&tar, io->buffer, padded) != (ssize_t) padded)
+            {
+                fprintf(stderr, "ERROR: %s has a damaged extended header\n",
+                    tar.name);
+                corrupted++;
+                break;
+            }
+            io->buffer[size] = '\0';
+            if (type == 'L')
+            {
+                free(longname);
+                longname = psprintf("%s", io->buffer);
+            }
+            else if ((record = strstr(io->buffer, " path=")) != NULL)
+            {
+                free(longname);
+                longname = psprintf("%.*s", (int) strcspn(record + 6, "\n"),
+                    record + 6);
+            }
+            continue;
+        }
+
+        free(path);
+        if (longname != NULL)
+            path = longname;
+        else if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0')
+            path = psprintf("%.155s/%.100s", header + 345, header);
+        else
+            path = psprintf("%.100s", header);
+        longname = NULL;
+
+        name = path;
+        while (strncmp(name, "./", 2) == 0)
+            name += 2;
+
+        if ((type == '0' || type == '\0') && is_relation_path(name))
+        {
+            corrupted += scan_tar_member(&tar, name, size, &db, io);
+            if (tar.failed)
+                break;
+            padded -= size;
+        }
+        else if (verbose)
+            printf("DEBUG: skipping tar member %s\n", name);
+
+        if (!tar_skip(&tar, io, padded))
+        {
+            fprintf(stderr, "ERROR: %s ends in the middle of %s\n", tar.name,
+                name);
+            corrupted++;
+            break;
+        }
+    }
+
+    if (tar.pipe != NULL)
+        tar_pipe_finish(tar.pipe);
+    if (tar.fd != STDIN_FILENO)
+        close(tar.fd);
+    free(path);
+    free(longname);
+
+    return corrupted;
+}
+
+static bool
+valid_page_size(uint32 size)
+{
+    return size >= MIN_BLCKSZ && size <= MAX_BLCKSZ && (size & (size - 1)) == 0;
+}
+
+static void
+read_control_file(Cluster *cluster)
+{
+    /* The page size and the segment size are fixed when postgres is built,
+     * a cluster records them in pg_control.  Its layout changes with
+     * PG_CONTROL_VERSION, so only a pg_control of the version of the
+     * headers is used.  Without it, as in a copy of base alone, the scan
+     * goes on with the sizes of the headers or those of --block-size and
+     * --segment-blocks.  The catalog version is kept as well, it names the
+     * directory of the cluster in its tablespaces.
+     */
+    ControlFileData control;
+    const char *datadir = cluster->datadir;
+    char *path = psprintf("%s/global/pg_control", datadir);
+    ssize_t nread = -1;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        nread = read_fully(fd, (char *) &control, sizeof(control), 0);
+        close(fd);
+    }
+
+    if (nread != sizeof(control))
+    {
+        if (verbose)
+            printf("DEBUG: %s cannot be read, assuming %u byte pages and "
+                "%u blocks per segment\n", path, page_size, segment_blocks);
+    }
+    else if (control.pg_control_version != PG_CONTROL_VERSION)
+        fprintf(stderr, "WARNING: %s has version %u instead of %u, assuming "
+            "%u byte pages and %u blocks per segment\n", path,
+            control.pg_control_version, PG_CONTROL_VERSION, page_size,
+            segment_blocks);
+    else if (!valid_page_size(control.blcksz) || control.relseg_size == 0)
+        fprintf(stderr, "WARNING: %s is damaged, it has %u byte pages and %u "
+            "blocks per segment, assuming %u and %u\n", path, control.blcksz,
+            control.relseg_size, page_size, segment_blocks);
+    else
+    {
+        if ((page_size_set && control.blcksz != page_size) ||
+            (segment_blocks_set && control.relseg_size != segment_blocks))
+        {
+            fprintf(stderr, "ERROR: %s has %u byte pages and %u blocks per "
+                "segment, not %u and %u\n", path, control.blcksz,
+                control.relseg_size, page_size, segment_blocks);
+            exit(1);
+        }
+        if (control.data_checksum_version == 0)
+        {
+            fprintf(stderr, "WARNING: data checksums are not enabled in %s, "
+                "pages without a checksum are not verified\n", datadir);
+            checksums_disabled = 1;
+        }
+
+        page_size = control.blcksz;
+        segment_blocks = control.relseg_size;
+        cluster->version_dir = psprintf("PG_%s_%u", PG_MAJORVERSION,
+            control.catalog_version_no);
+        if (verbose)
+            printf("DEBUG: %s has %u byte pages and %u blocks per segment\n",
+                path, page_size, segment_blocks);
+    }
+
+    free(path);
+}
+
+static size_t
+parse_size(const char *value)
+{
+    /* parses a size in bytes with an optional k or M suffix, returns 0 if the
+     * value cannot be parsed
+     */
+    char *end;
+    unsigned long long size = strtoull(value, &end, 10);
+
+    if (end == value)
+        return 0;
+    if (*end == 'k' || *end == 'K')
+    {
+        size *= 1024;
+        end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        size *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0')
+        return 0;
+
+    return size;
+}
+
+static void
+add_cluster(const char *path)
+{
+    /* The relation files under base, global and pg_tblspc are scanned from
+     * the data directory, see scan_data_directory().  Trailing slashes are
+     * dropped so that paths are built the same way however the directory
+     * was given.
+     */
+    Cluster *cluster;
+    size_t len;
+
+    clusters = realloc(clusters, (num_clusters + 1) * sizeof(Cluster));
+    if (clusters == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory adding %s\n", path);
+        exit(1);
+    }
+    cluster = &clusters[num_clusters++];
+    cluster->datadir = psprintf("%s", path);
+    cluster->version_dir = TABLESPACE_VERSION_DIRECTORY;
+    cluster->corrupted = 0;
+    len = strlen(cluster->datadir);
+    while (len > 1 && cluster->datadir[len - 1] == '/')
+        cluster->datadir[--len] = '\0';
+}
+
+static void
+read_cluster_list(const char *path)
+{
+    /* one data directory per line, blank lines and # comments are skipped */
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "ERROR: %s: --datadir-list %s cannot be read\n",
+            strerror(errno), path);
+        exit(1);
+    }
+    while ((len = getline(&line, &size, fp)) >= 0)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len > 0 && line[0] != '#')
+            add_cluster(line);
+    }
+    if (ferror(fp))
+    {
+        fprintf(stderr, "ERROR: %s: --datadir-list %s cannot be read\n",
+            strerror(errno), path);
+        exit(1);
+    }
+    if (fp != stdin)
+        fclose(fp);
+    free(line);
+}
+
+static void
+print_help(const char *argv_value)
+{
+    printf("Usage: %s [OPTIONS]\n", argv_value);
+    printf("  -v                        verbose\n");
+    printf("  -c, --dumpcorrupted=DIR   write the image of every corrupt page\n");
+    printf("                            to a file in DIR\n");
+    printf("  -J, --report=FILE         write a JSON line for every corrupt\n");
+    printf("                            page to FILE, - is stdout\n");
+    printf("  -Z, --digests=FILE        write a digest of the page checksums\n");
+    printf("                            of every segment file to FILE\n");
+    printf("  -C, --compare-digests=FILE  compare the digests of the segment\n");
+    printf("                            files with FILE of --digests, written\n");
+    printf("                            for another copy of the cluster\n");
+    printf("  -H, --check-headers       also verify the page headers the way\n");
+    printf("                            the server and amcheck do, and count\n");
+    printf("                            new and empty pages\n");
+    printf("  -e, --recheck=MS          read pages that fail again after MS\n");
+    printf("                            milliseconds and only report those\n");
+    printf("                            still failing, for a running server\n");
+    printf("  -k, --block-size=SIZE     page size of clusters without a\n");
+    printf("                            pg_control and of --tar archives,\n");
+    printf("                            default %d\n", BLCKSZ);
+    printf("  -K, --segment-blocks=N    blocks per segment file of clusters\n");
+    printf("                            without a pg_control and of --tar\n");
+    printf("                            archives, default %d\n", RELSEG_SIZE);
+    printf("  -b, --buffer-size=SIZE    read SIZE bytes per read(), k and M\n");
+    printf("                            suffixes allowed (default 1M)\n");
+    printf("  -d, --direct-io           read with O_DIRECT, bypassing the page\n");
+    printf("                            cache of the running server\n");
+    printf("  -D directory              data directory, may be given more\n");
+    printf("                            than once\n");
+    printf("  -l, --datadir-list=FILE   also verify the data directories\n");
+    printf("                            listed in FILE, one per line\n");
+    printf("  -t, --tar=FILE            verify the relation files in the tar\n");
+    printf("                            archive FILE, - reads it from stdin\n");
+    printf("  -U, --url-list=FILE       verify the segment files at the\n");
+    printf("                            http:// URLs listed in FILE, each\n");
+    printf("                            optionally followed by its size\n");
+    printf("  -A, --http-header=HEADER  send HEADER with every request of\n");
+    printf("                            --url-list, may be given more than\n");
+    printf("                            once\n");
+    printf("  -f, --fadvise             drop pages read by the scan from the\n");
+    printf("                            page cache once they are verified\n");
+    printf("  -r, --max-rate=MB         read at most MB megabytes per second\n");
+    printf("  -i, --max-iops=N          issue at most N reads per second\n");
+    printf("  -s, --stats               print read, checksum and directory walk\n");
+    printf("                            times and throughput per database\n");
+    printf("  -E, --metrics=FILE        keep progress, throughput and latency\n");
+    printf("                            metrics in FILE for the Prometheus\n");
+    printf("                            textfile collector\n");
+    printf("  -u, --io-uring            read with io_uring, falls back to\n");
+    printf("                            blocking reads if unavailable\n");
+    printf("  -q, --queue-depth=N       reads in flight per worker with\n");
+    printf("                            io_uring (default %d)\n", DEFAULT_IO_DEPTH);
+    printf("  -j, --jobs=N              scan with N worker threads (default 1)\n");
+    printf("  -N, --numa=NODES          pin each worker to a CPU and its\n");
+    printf("                            buffers to the memory of its node:\n");
+    printf("                            spread over all nodes, device for the\n");
+    printf("                            node of the data directory's disk,\n");
+    printf("                            or a node number\n");
+    printf("  -M, --manifest=FILE       skip segment files unchanged since they\n");
+    printf("                            were verified clean by the run that\n");
+    printf("                            wrote FILE, then rewrite FILE\n");
+    printf("  -F, --force-full          verify all segment files even if they\n");
+    printf("                            are unchanged according to --manifest\n");
+    printf("  -m, --mmap                checksum pages in place in a read-only\n");
+    printf("                            mapping of each segment file\n");
+    printf("  -R, --relfilenode=N       only verify the relation file N\n");
+    printf("  -o, --database-oid=OID    only verify the database OID, 0 for\n");
+    printf("                            the shared catalogs in global\n");
+    printf("  -g, --segment=N           only verify segment N of --relfilenode\n");
+    printf("  -B, --blocks=START[-END]  only verify blocks START to END of\n");
+    printf("                            --relfilenode, counted from the start\n");
+    printf("                            of the relation\n");
+    printf("  -p, --sample=P[%%]         verify a random P percent of the pages\n");
+    printf("                            of each segment file\n");
+    printf("  -n, --sample-pages=N      verify N random pages of each segment\n");
+    printf("                            file\n");
+    printf("  -S, --sample-seed=SEED    pick the same sampled pages as an\n");
+    printf("                            earlier run that printed SEED\n");
+    printf("  -w, --daemon=FILE         verify the cluster in passes until\n");
+    printf("                            stopped, resuming the pass recorded\n");
+    printf("                            in FILE, recently modified segment\n");
+    printf("                            files first, needs --pass-days or\n");
+    printf("                            --max-rate\n");
+    printf("  -P, --pass-days=DAYS      pace each --daemon pass to take DAYS,\n");
+    printf("                            capped by --max-rate\n");
+    printf("  -x, --fail-fast           stop at the first corrupt page\n");
+    printf("  -X, --max-corrupt=N       stop once N corrupt pages are found\n");
+    printf("  -h, --help                print this help and exit\n");
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    /*
+     * Flow is to use a data directory and traverse to find segments, each
+     * segment file is then scanned for corrupt pages.
+     */
+
+    int c;
+    int i;
+    uint64 found;
+    uint64 corrupted_pages_found = 0;
+    uint64 digests_differ = 0;
+    uint64 scan_start = 0;
+    const char *short_opt = "A:b:B:c:C:dD:e:E:fFg:hHi:j:J:k:K:l:mM:n:N:o:p:P:q:r:R:sS:t:uU:vw:xX:Z:";
+    char *datadir = NULL;
+    char *basedir;
+    struct stat statbuf;
+    bool targeted;
+    struct option long_opt[] =
+    {
+        {"block-size",    required_argument, NULL, 'k'},
+        {"blocks",        required_argument, NULL, 'B'},
+        {"buffer-size",   required_argument, NULL, 'b'},
+        {"check-headers", no_argument,       NULL, 'H'},
+        {"compare-digests", required_argument, NULL, 'C'},
+        {"daemon",        required_argument, NULL, 'w'},
+        {"database-oid",  required_argument, NULL, 'o'},
+        {"digests",       required_argument, NULL, 'Z'},
+        {"dumpcorrupted", required_argument, NULL, 'c'},
+        {"datadir",       required_argument, NULL, 'D'},
+        {"datadir-list",  required_argument, NULL, 'l'},
+        {"direct-io",     no_argument,       NULL, 'd'},
+        {"fadvise",       no_argument,       NULL, 'f'},
+        {"fail-fast",     no_argument,       NULL, 'x'},
+        {"force-full",    no_argument,       NULL, 'F'},
+        {"help",          no_argument,       NULL, 'h'},
+        {"http-header",   required_argument, NULL, 'A'},
+        {"io-uring",      no_argument,       NULL, 'u'},
+        {"jobs",          required_argument, NULL, 'j'},
+        {"manifest",      required_argument, NULL, 'M'},
+        {"max-corrupt",   required_argument, NULL, 'X'},
+        {"max-iops",      required_argument, NULL, 'i'},
+        {"max-rate",      required_argument, NULL, 'r'},
+        {"metrics",       required_argument, NULL, 'E'},
+        {"mmap",          no_argument,       NULL, 'm'},
+        {"numa",          required_argument, NULL, 'N'},
+        {"pass-days",     required_argument, NULL, 'P'},
+        {"queue-depth",   required_argument, NULL, 'q'},
+        {"recheck",       required_argument, NULL, 'e'},
+        {"relfilenode",   required_argument, NULL, 'R'},
+        {"report",        required_argument, NULL, 'J'},
+        {"sample",        required_argument, NULL, 'p'},
+        {"sample-pages",  required_argument, NULL, 'n'},
+        {"sample-seed",   required_argument, NULL, 'S'},
+        {"segment",       required_argument, NULL, 'g'},
+        {"segment-blocks", required_argument, NULL, 'K'},
+        {"stats",         no_argument,       NULL, 's'},
+        {"tar",           required_argument, NULL, 't'},
+        {"url-list",      required_argument, NULL, 'U'},
+        {"verbose",       no_argument,       NULL, 'v'},
+        {NULL,            0,                 NULL, 0  }
+    };
+
+    /* if no arguments passed, print help and exit(1) */
+    if (argc == 1)
+    {
+        print_help(argv[0]);
+        exit(1);
+    }
+
+    while((c = getopt_long(argc, argv, short_opt, long_opt, NULL)) != -1)
+    {
+        switch(c)
+        {
             case -1:       /* no more arguments */
             case 0:        /* long options toggles */
                 break;
 
+            case 'b':
+                /* checked against the page size once it is known */
+                read_buffer_size = parse_size(optarg);
+                if (read_buffer_size == 0 ||
+                    read_buffer_size > MAX_READ_BUFFER_SIZE)
+                {
+                    fprintf(stderr, "ERROR: -b argument must be a size up to "
+                        "%d bytes\n", MAX_READ_BUFFER_SIZE);
+                    exit(1);
+                }
+                break;
+
+            case 'k':
+                page_size = parse_size(optarg);
+                if (!valid_page_size(page_size))
+                {
+                    fprintf(stderr, "ERROR: -k argument must be a power of 2 "
+                        "from %d to %d\n", MIN_BLCKSZ, MAX_BLCKSZ);
+                    exit(1);
+                }
+                page_size_set = 1;
+                break;
+
+            case 'K':
+                segment_blocks = strtoul(optarg, NULL, 10);
+                if (segment_blocks == 0)
+                {
+                    fprintf(stderr, "ERROR: -K argument must be a number of "
+                        "blocks\n");
+                    exit(1);
+                }
+                segment_blocks_set = 1;
+                break;
+
             case 'c':
-                dump_corrupted = 1;
+                dump_dir = optarg;
                 break;
 
-            case 'v':
-                verbose = 1;
+            case 'w':
+                cursor_file = optarg;
                 break;
 
-            case 'D':
-                if (optarg)
+            case 'E':
+                metrics_file = optarg;
+                break;
+
+            case 'P':
+                pass_days = atof(optarg);
+                if (pass_days <= 0)
+                {
+                    fprintf(stderr, "ERROR: -P argument must be a positive "
+                        "number of days\n");
+                    exit(1);
+                }
+                break;
+
+            case 'J':
+                report_file = optarg;
+                break;
+
+            case 'd':
+                direct_io = 1;
+                break;
+
+            case 'f':
+                fadvise_cache = 1;
+                break;
+
+            case 'm':
+                use_mmap = 1;
+                break;
+
+            case 'M':
+                manifest_file = optarg;
+                break;
+
+            case 'N':
+                numa_mode = optarg;
+                if (strcmp(optarg, "spread") != 0 &&
+                    strcmp(optarg, "device") != 0 &&
+                    (strspn(optarg, "0123456789") != strlen(optarg) ||
+                     *optarg == '\0' || atoi(optarg) >= MAX_NUMA_NODES))
+                {
+                    fprintf(stderr, "ERROR: --numa must be spread, device or "
+                        "a node number\n");
+                    exit(1);
+                }
+                break;
+
+            case 's':
+                show_stats = 1;
+                break;
+
+            case 'H':
+                check_headers = 1;
+                break;
+
+            case 'Z':
+                digest_file = optarg;
+                break;
+
+            case 'C':
+                compare_file = optarg;
+                break;
+
+            case 'e':
                 {
-                    /* '-D' argument of data directory must contain 'base'
-                     * directory to scan, check if trailing back slash and
-                     * append appropriately.  Must use base since other
-                     * directories, such as pg_xlog, contain currently
-                     * unsupported file types.
-                     */
-                    strcpy(datadir, optarg);
-                    if (strcmp(&optarg[strlen(optarg) - 1], "/") == 0)
+                    char *end;
+                    unsigned long delay = strtoul(optarg, &end, 10);
+
+                    if (end == optarg || *end != '\0' || *optarg == '-' ||
+                        delay == 0 || delay > 60000)
+                    {
+                        fprintf(stderr, "ERROR: --recheck must be a delay "
+                            "from 1 to 60000 ms\n");
+                        exit(1);
+                    }
+                    recheck_delay = delay;
+                }
+                break;
+
+            case 't':
+                tar_file = optarg;
+                break;
+
+            case 'U':
+                url_list = optarg;
+                break;
+
+            case 'x':
+                max_corrupt = 1;
+                break;
+
+            case 'X':
+                {
+                    char *end;
+
+                    max_corrupt = strtoull(optarg, &end, 10);
+                    if (end == optarg || *end != '\0' || max_corrupt == 0 ||
+                        *optarg == '-')
+                    {
+                        fprintf(stderr, "ERROR: --max-corrupt must be a "
+                            "number of pages, at least 1\n");
+                        exit(1);
+                    }
+                }
+                break;
+
+            case 'A':
+                if (strchr(optarg, ':') == NULL ||
+                    strpbrk(optarg, "\r\n") != NULL)
+                {
+                    fprintf(stderr, "ERROR: --http-header must be a "
+                        "\"Name: value\" header\n");
+                    exit(1);
+                }
+                add_http_header(optarg);
+                break;
+
+            case 'r':
+                max_rate = atof(optarg);
+                if (max_rate <= 0)
+                {
+                    fprintf(stderr, "ERROR: -r argument must be a positive "
+                        "number of MB/s\n");
+                    exit(1);
+                }
+                break;
+
+            case 'i':
+                max_iops = atof(optarg);
+                if (max_iops <= 0)
+                {
+                    fprintf(stderr, "ERROR: -i argument must be a positive "
+                        "number of reads per second\n");
+                    exit(1);
+                }
+                break;
+
+            case 'F':
+                force_full = 1;
+                break;
+
+            case 'p':
+                {
+                    char *end;
+
+                    sample_percent = strtod(optarg, &end);
+                    if (*end == '%')
+                        end++;
+                    if (end == optarg || *end != '\0' ||
+                        !(sample_percent > 0 && sample_percent <= 100))
+                    {
+                        fprintf(stderr, "ERROR: -p argument must be a "
+                            "percentage above 0 and up to 100\n");
+                        exit(1);
+                    }
+                }
+                break;
+
+            case 'n':
+                sample_pages = atoi(optarg);
+                if (sample_pages < 1)
+                {
+                    fprintf(stderr, "ERROR: -n argument must be at least 1\n");
+                    exit(1);
+                }
+                break;
+
+            case 'S':
+                sample_seed = strtoull(optarg, NULL, 10);
+                sample_seed_set = 1;
+                break;
+
+            case 'R':
+            case 'o':
+                {
+                    char *end;
+                    unsigned long oid = strtoul(optarg, &end, 10);
+
+                    if (end == optarg || *end != '\0' || oid > UINT32_MAX ||
+                        (c == 'R' && oid == InvalidOid))
                     {
-                        strcat(datadir, "base");
+                        fprintf(stderr, "ERROR: -%c argument must be an OID\n",
+                            c);
+                        exit(1);
                     }
+                    if (c == 'R')
+                        target_relfilenode = oid;
                     else
                     {
-                        strcat(datadir, "/base");
+                        target_database = oid;
+                        target_database_set = 1;
+                    }
+                }
+                break;
+
+            case 'g':
+                target_segment = atol(optarg);
+                if (target_segment < 0)
+                {
+                    fprintf(stderr, "ERROR: -g argument must be a segment "
+                        "number\n");
+                    exit(1);
+                }
+                break;
+
+            case 'B':
+                {
+                    /* START, START- or START-END, END is included */
+                    char *end;
+                    unsigned long long first, last;
+
+                    first = strtoull(optarg, &end, 10);
+                    last = first;
+                    if (end != optarg && *end == '-')
+                    {
+                        if (end[1] == '\0')
+                        {
+                            last = InvalidBlockNumber;
+                            end++;
+                        }
+                        else
+                            last = strtoull(end + 1, &end, 10);
                     }
+                    if (end == optarg || *end != '\0' || last < first ||
+                        last > InvalidBlockNumber)
+                    {
+                        fprintf(stderr, "ERROR: -B argument must be a block "
+                            "number or range START-END\n");
+                        exit(1);
+                    }
+                    target_startblk = first;
+                    target_endblk = last >= InvalidBlockNumber - 1 ?
+                        InvalidBlockNumber : last + 1;
                 }
+                break;
+
+            case 'v':
+                verbose = 1;
+                break;
+
+            case 'D':
+                if (optarg)
+                    add_cluster(optarg);
                 else
                 {
                     fprintf(stderr, "ERROR: -D argument could not be parsed\n");
@@ -324,6 +7026,39 @@ main(int argc, char *argv[])
                 }
                 break;
 
+            case 'l':
+                read_cluster_list(optarg);
+                break;
+
+            case 'j':
+                num_workers = atoi(optarg);
+                if (num_workers < 1)
+                {
+                    fprintf(stderr, "ERROR: -j argument must be at least 1\n");
+                    exit(1);
+                }
+                break;
+
+            case 'u':
+#ifdef USE_IO_URING
+                use_io_uring = 1;
+#else
+                fprintf(stderr, "ERROR: built without io_uring support, "
+                    "rebuild with make USE_IO_URING=1\n");
+                exit(1);
+#endif
+                break;
+
+            case 'q':
+                io_depth = atoi(optarg);
+                if (io_depth < 1 || io_depth > MAX_IO_DEPTH)
+                {
+                    fprintf(stderr, "ERROR: -q argument must be between 1 and %d\n",
+                        MAX_IO_DEPTH);
+                    exit(1);
+                }
+                break;
+
             case 'h':
                 print_help(argv[0]);
                 exit(1);
@@ -335,23 +7070,321 @@ main(int argc, char *argv[])
         };
     };
 
-    lstat(datadir, &statbuf);
-    if (!S_ISDIR(statbuf.st_mode))
+    if (use_mmap && (direct_io || use_io_uring))
+    {
+        fprintf(stderr, "ERROR: --mmap cannot be combined with --direct-io "
+            "or --io-uring\n");
+        exit(1);
+    }
+    if (use_mmap)
+        signal(SIGBUS, mmap_fault_handler);
+
+    if (sample_percent > 0 && sample_pages > 0)
+    {
+        fprintf(stderr, "ERROR: --sample and --sample-pages cannot be "
+            "combined\n");
+        exit(1);
+    }
+    if ((sample_percent > 0 || sample_pages > 0) &&
+        (use_mmap || use_io_uring || manifest_file != NULL))
+    {
+        /* sampled pages are read with pread(), and a sampled file is not
+         * known to be clean, so it must not be recorded in the manifest
+         */
+        fprintf(stderr, "ERROR: sampling cannot be combined with --mmap, "
+            "--io-uring or --manifest\n");
+        exit(1);
+    }
+    if ((target_segment >= 0 || target_startblk > 0 ||
+         target_endblk != InvalidBlockNumber) &&
+        target_relfilenode == InvalidOid)
+    {
+        fprintf(stderr, "ERROR: --segment and --blocks need --relfilenode\n");
+        exit(1);
+    }
+    if ((target_relfilenode != InvalidOid || target_database_set) &&
+        manifest_file != NULL)
+    {
+        /* the manifest only keeps the files verified by this run */
+        fprintf(stderr, "ERROR: --relfilenode and --database-oid cannot be "
+            "combined with --manifest\n");
+        exit(1);
+    }
+
+    targeted = target_relfilenode != InvalidOid || target_database_set;
+    datadir = num_clusters > 0 ? clusters[0].datadir : NULL;
+    if (num_clusters > 1 &&
+        (cursor_file != NULL || manifest_file != NULL || targeted))
+    {
+        /* the cursor and the manifest record the files of one cluster */
+        fprintf(stderr, "ERROR: several data directories cannot be combined "
+            "with --daemon, --manifest or targeted options\n");
+        exit(1);
+    }
+    if (tar_file != NULL &&
+        (datadir != NULL || num_workers > 1 || use_mmap || use_io_uring ||
+         direct_io || fadvise_cache || manifest_file != NULL || targeted ||
+         sample_percent > 0 || sample_pages > 0))
+    {
+        /* an archive is read front to back on one thread */
+        fprintf(stderr, "ERROR: --tar cannot be combined with -D, --jobs, "
+            "--mmap, --io-uring, --direct-io, --fadvise, --manifest, "
+            "sampling or targeted options\n");
+        exit(1);
+    }
+    if (cursor_file != NULL &&
+        (tar_file != NULL || num_workers > 1 || manifest_file != NULL ||
+         targeted || sample_percent > 0 || sample_pages > 0 || show_stats))
+    {
+        /* a pass is paced on one thread and verifies every page */
+        fprintf(stderr, "ERROR: --daemon cannot be combined with --tar, "
+            "--jobs, --manifest, --stats, sampling or targeted options\n");
+        exit(1);
+    }
+    if (recheck_delay > 0 && tar_file != NULL)
+    {
+        /* an archive does not change while it is read */
+        fprintf(stderr, "ERROR: --recheck cannot be combined with --tar\n");
+        exit(1);
+    }
+    if (max_corrupt > 0 && cursor_file != NULL)
+    {
+        /* a daemon reports corruption pass by pass and keeps going */
+        fprintf(stderr, "ERROR: --fail-fast and --max-corrupt cannot be "
+            "combined with --daemon\n");
+        exit(1);
+    }
+    if (numa_mode != NULL && num_workers < 2)
+    {
+        fprintf(stderr, "ERROR: --numa needs --jobs\n");
+        exit(1);
+    }
+    if (url_list != NULL &&
+        (tar_file != NULL || datadir != NULL || cursor_file != NULL ||
+         manifest_file != NULL || targeted || use_mmap || use_io_uring ||
+         direct_io || fadvise_cache || sample_percent > 0 || sample_pages > 0))
+    {
+        /* objects are streamed, there is nothing to map, cache or seek */
+        fprintf(stderr, "ERROR: --url-list cannot be combined with -D, --tar, "
+            "--daemon, --manifest, --mmap, --io-uring, --direct-io, "
+            "--fadvise, sampling or targeted options\n");
+        exit(1);
+    }
+    if ((digest_file != NULL || compare_file != NULL) &&
+        (num_clusters > 1 || url_list != NULL || cursor_file != NULL ||
+         targeted || sample_percent > 0 || sample_pages > 0))
+    {
+        /* a digest covers every page of a segment file of one cluster */
+        fprintf(stderr, "ERROR: --digests and --compare-digests cannot be "
+            "combined with several data directories, --url-list, --daemon, "
+            "sampling or targeted options\n");
+        exit(1);
+    }
+    keep_records = manifest_file != NULL || digest_file != NULL ||
+        compare_file != NULL;
+    if (http_headers != NULL && url_list == NULL)
+    {
+        fprintf(stderr, "ERROR: --http-header needs --url-list\n");
+        exit(1);
+    }
+    if (pass_days > 0 && cursor_file == NULL)
+    {
+        fprintf(stderr, "ERROR: --pass-days needs --daemon\n");
+        exit(1);
+    }
+    if (cursor_file != NULL && pass_days <= 0 && max_rate <= 0)
+    {
+        /* unpaced passes would read the cluster at full speed, forever */
+        fprintf(stderr, "ERROR: --daemon needs --pass-days or --max-rate\n");
+        exit(1);
+    }
+    if (tar_file == NULL && datadir == NULL && url_list == NULL)
+    {
+        fprintf(stderr, "ERROR: -D, --tar or --url-list is required\n");
+        exit(1);
+    }
+    if (!sample_seed_set)
+        sample_seed = (uint64) time(NULL) ^ ((uint64) getpid() << 32);
+
+    for (i = 0; i < num_clusters; i++)
+    {
+        /* the clusters of one run share the page and segment size */
+        read_control_file(&clusters[i]);
+        page_size_set = segment_blocks_set = 1;
+    }
+    if (read_buffer_size < page_size || read_buffer_size % page_size != 0)
+    {
+        fprintf(stderr, "ERROR: -b argument must be a multiple of the %u "
+            "byte pages\n", page_size);
+        exit(1);
+    }
+    if (target_segment > InvalidBlockNumber / segment_blocks)
+    {
+        fprintf(stderr, "ERROR: -g argument must be a segment number\n");
+        exit(1);
+    }
+    if (target_segment >= 0 &&
+        (target_startblk >= (target_segment + 1) * segment_blocks ||
+         target_endblk <= target_segment * segment_blocks))
+    {
+        fprintf(stderr, "ERROR: --blocks are not in --segment %ld\n",
+            target_segment);
+        exit(1);
+    }
+
+    os_page_size = sysconf(_SC_PAGESIZE);
+    select_checksum_kernel();
+
+    for (i = 0; i < num_clusters; i++)
+    {
+        basedir = psprintf("%s/base", clusters[i].datadir);
+        if (stat(basedir, &statbuf) < 0 || !S_ISDIR(statbuf.st_mode))
+        {
+            fprintf(stderr, "ERROR: base %s is not a directory\n", basedir);
+            exit(1);
+        }
+        free(basedir);
+    }
+
+    /* paths in the manifest and the stats are relative to the data
+     * directory, so that they stay the same when -D is spelled differently;
+     * member names of an archive already are.  With several clusters the
+     * paths are kept whole to tell them apart.
+     */
+    manifest.prefix_len = num_clusters == 1 ? strlen(datadir) + 1 : 0;
+    if (manifest_file != NULL)
+        load_manifest(manifest_file);
+
+    if (dump_dir != NULL && mkdir(dump_dir, 0700) < 0 && errno != EEXIST)
     {
-        fprintf(stderr, "ERROR: base %s is not a directory\n", datadir);
+        fprintf(stderr, "ERROR: %s: %s cannot be created\n", strerror(errno),
+            dump_dir);
         exit(1);
     }
+    if (report_file != NULL || dump_dir != NULL)
+        start_report_writer();
+    measure_times = show_stats || metrics_file != NULL;
+    if (metrics_file != NULL)
+        start_metrics_writer();
+
+    if (show_stats)
+        scan_start = stats_clock();
+
+    if (tar_file != NULL)
+    {
+        init_scan_io(&scan_io);
+        corrupted_pages_found = scan_tar(tar_file, &scan_io);
+        release_scan_io(&scan_io);
+    }
+    else if (cursor_file != NULL)
+    {
+        init_scan_io(&scan_io);
+        current_cluster = &clusters[0];
+        run_daemon(datadir);
+        release_scan_io(&scan_io);
+    }
+    else if (num_workers > 1)
+    {
+        if (numa_mode != NULL)
+            plan_numa_placement(datadir);
+        start_workers();
+        current_cluster = &clusters[0];
+        if (targeted)
+            corrupted_pages_found = scan_targets(datadir);
+        for (i = 0; i < num_clusters && !targeted; i++)
+        {
+            /* the workers walk the clusters in parallel, their files are
+             * scheduled together
+             */
+            current_cluster = &clusters[i];
+            found = scan_data_directory(clusters[i].datadir);
+            __sync_fetch_and_add(&clusters[i].corrupted, found);
+            corrupted_pages_found += found;
+        }
+        if (url_list != NULL)
+            corrupted_pages_found = scan_url_list(url_list);
+        schedule_plan();
+        corrupted_pages_found += finish_workers();
+    }
+    else
+    {
+        init_scan_io(&scan_io);
+        current_cluster = &clusters[0];
+        if (targeted)
+            corrupted_pages_found = scan_targets(datadir);
+        for (i = 0; i < num_clusters && !targeted; i++)
+        {
+            current_cluster = &clusters[i];
+            clusters[i].corrupted = scan_data_directory(clusters[i].datadir);
+            corrupted_pages_found += clusters[i].corrupted;
+        }
+        if (url_list != NULL)
+            corrupted_pages_found = scan_url_list(url_list);
+        release_scan_io(&scan_io);
+    }
+
+    if (report_file != NULL || dump_dir != NULL)
+        finish_report_writer();
+    if (metrics_file != NULL)
+        finish_metrics_writer();
+
+    /* a daemon only stops when asked to, its passes printed their results */
+    if (cursor_file != NULL)
+        exit(0);
+
+    /* files of a stopped scan may have been verified only in part */
+    if (scan_stopped())
+        fprintf(stderr, "WARNING: stopped after %llu corrupt pages, not "
+            "all pages were verified%s\n",
+            (unsigned long long) corruption_seen,
+            manifest_file != NULL || digest_file != NULL ?
+            ", --manifest and --digests are left as they were" : "");
+    else
+    {
+        if (manifest_file != NULL)
+            write_manifest(manifest_file);
+        if (digest_file != NULL)
+            write_digests(digest_file);
+        if (compare_file != NULL)
+            digests_differ = compare_digests(compare_file);
+    }
+
+    if (show_stats)
+        print_stats(stats_clock() - scan_start);
+
+    if (sample_percent > 0 || sample_pages > 0)
+        print_sample_report(corrupted_pages_found);
+
+    for (i = 0; i < num_clusters && num_clusters > 1; i++)
+    {
+        if (clusters[i].corrupted > 0)
+            printf("CLUSTER %s: CORRUPTION FOUND: %llu\n", clusters[i].datadir,
+                (unsigned long long) clusters[i].corrupted);
+        else
+            printf("CLUSTER %s: NO CORRUPTION FOUND\n", clusters[i].datadir);
+    }
 
-    corrupted_pages_found = scan_directory(datadir);
+    if (check_headers)
+        printf("HEADERS: %llu new pages, %llu empty pages, %llu invalid "
+            "headers\n",
+            (unsigned long long) scan_stats.totals.new_pages,
+            (unsigned long long) scan_stats.totals.empty_pages,
+            (unsigned long long) scan_stats.totals.bad_headers);
+    if (recheck_delay > 0)
+        printf("RECHECKED: %llu pages were being written and verified when "
+            "read again\n",
+            (unsigned long long) scan_stats.totals.torn_pages);
 
     if (corrupted_pages_found > 0)
     {
-        printf("CORRUPTION FOUND: %d\n", corrupted_pages_found);
+        printf("CORRUPTION FOUND: %llu\n",
+            (unsigned long long) corrupted_pages_found);
         exit(1);
     }
     else
     {
         printf("NO CORRUPTION FOUND\n");
-        exit(0);
+        /* the pages are fine, but not the same as those of the other copy */
+        exit(digests_differ > 0 ? 1 : 0);
     }
 }